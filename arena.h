@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Arena, per measurement memory from one preallocated block
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena {
+    unsigned char   *base;
+    size_t          size;
+    size_t          used;
+    size_t          peak;                   /* Highest use since arena_init */
+    unsigned long   allocs;                 /* Since the last reset */
+    unsigned long   failed;
+};
+
+int arena_init(struct arena *a, size_t size);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif
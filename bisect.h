@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Bisection and tracking of the second boundary of a web server clock,
+ * internal to libhtpdate and htpsim (not installed)
+ */
+
+#ifndef BISECT_H
+#define BISECT_H
+
+#include <time.h>
+
+#include "htp.h"
+
+#define HTP_TRACK_INTERVAL  60              /* Minimum s between offsets for a rate */
+
+/* Return values of the probe operation */
+#define HTP_PROBE_ERROR     -1
+#define HTP_PROBE_DATE      0               /* Date header in sample */
+#define HTP_PROBE_HIRES     1               /* High resolution offset in sample */
+#define HTP_PROBE_RETRY     2               /* Nothing measured, probe again */
+
+/* Round trip time of a web server, kept across measurements (RFC 6298) */
+struct htp_rtt {
+    long        srtt;                       /* Smoothed round trip time */
+    long        rttvar;                     /* Smoothed mean deviation */
+};
+
+/* State of the bisection of the second boundary of a web server clock */
+struct bisect {
+    int         precision;                  /* Probes to go */
+    int         polls;                      /* Probes done */
+    long        nap;                        /* Step size */
+    long        when;                       /* Target time in the second */
+    long        start;                      /* First target time */
+    long        verify;                     /* Final target time while checking the clock runs */
+    int         ticked;                     /* Second boundary seen */
+    int         stale;                      /* Clock of the web server doesn't run */
+    long        latency;                    /* From sending to the server clock reading */
+    long        rtt;                        /* Round trip time of last probe */
+    long        net;                        /* Network part of the round trip, 0 if unknown */
+    long long   offset, first_offset, prev_offset;
+    struct htp_rtt *jitter;                 /* Stop below the uncertainty, or NULL */
+
+    /* Tracking, probes either side of a predicted second boundary */
+    int         tracking;                   /* Tracking probes to go */
+    int         full;                       /* Precision of the fallback bisection */
+    long        half;                       /* Half the window around the boundary */
+    double      predicted;                  /* Offset */
+    long long   date1, arrival1;            /* First probe, arrival in ns since the epoch */
+    double      tracked;                    /* Offset, HTP_ERROR if not tracked */
+};
+
+/* Second boundary of a web server, kept across measurements */
+struct htp_track {
+    int             valid;
+    struct timespec at;                     /* Of the last offset */
+    double          offset;
+    double          rate;                   /* Change of the offset, s/s */
+    double          error;                  /* Of the last prediction, s */
+    long            latency;
+    long            rtt;
+};
+
+/* Result of a single request to a web server */
+struct htp_sample {
+    struct timespec at;                     /* Scheduled send time */
+    struct timespec sent;
+    struct timespec received;
+    long long       date;                   /* Date header, seconds */
+    double          offset;                 /* High resolution time offset */
+};
+
+/* Clock and transport, the system clock and network for htpdate,
+   virtual ones for simulation
+*/
+struct htp_ops {
+    void    (*gettime)(void *arg, struct timespec *now);
+    void    (*sleep)(void *arg, const struct timespec *until);
+    int     (*probe)(void *arg, const struct bisect *b, struct htp_sample *sample);
+};
+
+void htp_rtt_update(struct htp_rtt *r, long rtt);
+void bisect_init(struct bisect *b, int precision, struct htp_rtt *jitter);
+void bisect_schedule(const struct bisect *b, const struct timespec *now, struct timespec *at);
+long bisect_latency(const struct bisect *b);
+void bisect_sample(struct bisect *b, const struct timespec *at, const struct timespec *received, long long date);
+int bisect_stale(const struct bisect *b);
+double bisect_result(const struct bisect *b);
+
+int track_start(const struct htp_track *t, struct bisect *b, const struct timespec *now);
+void track_update(struct htp_track *t, const struct timespec *now, double offset, long latency, long rtt);
+void track_shift(struct htp_track *t, double delta);
+
+double htp_bisect(struct bisect *b, int precision, struct htp_rtt *jitter, struct htp_track *track,
+    const struct htp_ops *ops, void *arg);
+
+#endif
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Binary capture of requests, one fixed size record per request
+ *
+ * The file starts with CAPTURE_MAGIC, followed by records of
+ * CAPTURE_RECORDSIZE bytes. Records are only ever appended.
+ */
+
+/* Needed for fileno with -std=c11 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+
+static void put32(unsigned char *p, uint32_t v) {
+    int i;
+
+    for (i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+
+static void put64(unsigned char *p, int64_t v) {
+    int i;
+
+    for (i = 0; i < 8; i++) p[i] = (unsigned char)((uint64_t)v >> (8 * i));
+}
+
+
+static uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static int64_t get64(const unsigned char *p) {
+    uint64_t v = 0;
+    int      i;
+
+    for (i = 7; i >= 0; i--) v = v << 8 | p[i];
+    return (int64_t)v;
+}
+
+
+/* Open a capture file for appending, a new file gets the magic first */
+FILE *capture_open(const char *path) {
+    struct stat st;
+    char        magic[CAPTURE_MAGICSIZE];
+    FILE        *fp = fopen(path, "a+b");
+
+    if (fp == NULL) return NULL;
+
+    /* Records are written per measurement, flushed per poll cycle; the
+       buffer can only be set before the first I/O on the stream
+    */
+    setvbuf(fp, NULL, _IOFBF, 64 * CAPTURE_RECORDSIZE);
+
+    if (fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if (st.st_size == 0) {
+        if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGICSIZE, 1, fp) != 1) {
+            fclose(fp);
+            return NULL;
+        }
+    } else if (fread(magic, CAPTURE_MAGICSIZE, 1, fp) != 1 ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGICSIZE) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    return fp;
+}
+
+
+int capture_write(FILE *fp, const struct capture_record *r, int n) {
+    unsigned char buf[CAPTURE_RECORDSIZE];
+
+    for (; n > 0; n--, r++) {
+        put32(buf, r->server);
+        put32(buf + 4, (uint32_t)r->step);
+        put32(buf + 8, (uint32_t)r->when);
+        put32(buf + 12, (uint32_t)r->nap);
+        put64(buf + 16, r->launch);
+        put64(buf + 24, r->sent);
+        put64(buf + 32, r->received);
+        put64(buf + 40, r->rtt);
+        put64(buf + 48, r->date);
+        put64(buf + 56, r->offset);
+        if (fwrite(buf, CAPTURE_RECORDSIZE, 1, fp) != 1) return -1;
+    }
+    return 0;
+}
+
+
+/* Read the next record, returns 0 at the end of the file */
+int capture_read(FILE *fp, struct capture_record *r) {
+    unsigned char buf[CAPTURE_RECORDSIZE];
+
+    if (fread(buf, CAPTURE_RECORDSIZE, 1, fp) != 1) return 0;
+
+    r->server   = get32(buf);
+    r->step     = (int32_t)get32(buf + 4);
+    r->when     = (int32_t)get32(buf + 8);
+    r->nap      = (int32_t)get32(buf + 12);
+    r->launch   = get64(buf + 16);
+    r->sent     = get64(buf + 24);
+    r->received = get64(buf + 32);
+    r->rtt      = get64(buf + 40);
+    r->date     = get64(buf + 48);
+    r->offset   = get64(buf + 56);
+    return 1;
+}
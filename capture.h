@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Binary capture of requests, one fixed size record per request
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC       "HTPCAP1\n"
+#define CAPTURE_MAGICSIZE   8
+#define CAPTURE_RECORDSIZE  64
+#define CAPTURE_NONE        INT64_MIN       /* No offset */
+
+/* All times in nanoseconds since the epoch, stored little endian */
+struct capture_record {
+    uint32_t    server;                     /* Position of URL on command line */
+    int32_t     step;                       /* Request number of the measurement */
+    int32_t     when;                       /* Bisection target in the second */
+    int32_t     nap;                        /* Bisection step size */
+    int64_t     launch;                     /* Scheduled send time */
+    int64_t     sent;
+    int64_t     received;
+    int64_t     rtt;
+    int64_t     date;                       /* Date header, seconds */
+    int64_t     offset;                     /* Resulting offset of the measurement */
+};
+
+FILE *capture_open(const char *path);
+int capture_write(FILE *fp, const struct capture_record *r, int n);
+int capture_read(FILE *fp, struct capture_record *r);
+
+#endif
@@ -0,0 +1,346 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * HTTP Time Protocol, bisection and selection of time offsets
+ *
+ * The Date header of a web server has a resolution of one second. By
+ * timing requests such that they arrive at the web server at a chosen
+ * moment within the second ("when"), and halving the step ("nap") with
+ * every request, the moment the web server clock ticks to the next
+ * second is found.
+ *
+ * Steps smaller than the jitter of the round trip time don't add
+ * accuracy, with the round trip time of the web server tracked, the
+ * bisection stops once the step falls below it.
+ *
+ * A cache may answer with a stored response and its old Date. If the
+ * offset didn't change at all during the bisection, the second boundary
+ * is either close to the end of the last step or the clock of the web
+ * server doesn't run; one more request in the next second, at the time
+ * of the first, tells which.
+ *
+ * Once a web server has been measured, the position of its second
+ * boundary in the next measurement follows from the last offset and
+ * how fast it changes. Tracking then places one request just before
+ * and one just after the predicted boundary, and only falls back to a
+ * full bisection when they don't straddle it.
+ *
+ * Without more knowledge the web server reads its clock halfway the
+ * round trip. When the network round trip is known (e.g. from the TCP
+ * stack), the rest is time spent by the web server before it answers,
+ * and the clock is read net/2 before the response arrives.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "bisect.h"
+
+
+void htp_rtt_update(struct htp_rtt *r, long rtt) {
+    if (r->srtt == 0) {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+        return;
+    }
+    r->rttvar += (labs(r->srtt - rtt) - r->rttvar) / 4;
+    r->srtt += (rtt - r->srtt) / 8;
+}
+
+
+void bisect_init(struct bisect *b, int precision, struct htp_rtt *jitter) {
+    b->precision = precision;
+    b->polls = 0;
+    b->nap = HTP_NS;
+    b->latency = 0;
+    b->rtt = 0;
+    b->net = 0;
+    b->when = b->start = b->nap >> precision;
+    b->verify = 0;
+    b->ticked = b->stale = 0;
+    b->offset = b->first_offset = b->prev_offset = 0;
+    b->jitter = jitter;
+    b->tracking = 0;
+    b->full = precision;
+    b->tracked = HTP_ERROR;
+}
+
+
+/* Time to send the next request, so it arrives at "when" */
+void bisect_schedule(const struct bisect *b, const struct timespec *now, struct timespec *at) {
+    at->tv_sec = now->tv_sec;
+    at->tv_nsec = (b->when - b->latency) % HTP_NS;
+    if (at->tv_nsec < 0) at->tv_nsec += HTP_NS;
+    if (at->tv_nsec < now->tv_nsec) at->tv_sec++;
+}
+
+
+/* Time from sending a request until the web server reads its clock */
+long bisect_latency(const struct bisect *b) {
+    if (b->net > 0 && b->net < b->rtt) return b->rtt - b->net / 2;
+    return b->rtt / 2;
+}
+
+
+/* A tracking probe. The first should see the second before the
+   boundary, the second the one after it; the boundary is then between
+   their arrivals at the web server, which confirms the predicted offset
+   to within the window.
+*/
+static void bisect_track(struct bisect *b, const struct timespec *at, long long date) {
+    long long   arrival = (long long)at->tv_sec * HTP_NS + at->tv_nsec + bisect_latency(b);
+    double      early, late;
+    long        latency;
+
+    b->polls++;
+    if (b->tracking == 2) {
+        b->date1 = date;
+        b->arrival1 = arrival;
+        b->when += 2 * b->half;
+        b->tracking = 1;
+        return;
+    }
+
+    /* The whole seconds of the offset (the Date less the seconds passed
+       since the first arrival) must step by one; a second probe that
+       missed its moment went out a second later, its Date is one further
+       for that alone
+    */
+    if (date - (arrival - b->arrival1) / HTP_NS == b->date1 + 1) {
+        /* Offsets for a boundary at the second and first arrival */
+        early = (double)(date - arrival / HTP_NS) - (double)(arrival % HTP_NS) / 1e9;
+        late = (double)(date - b->arrival1 / HTP_NS) - (double)(b->arrival1 % HTP_NS) / 1e9;
+        b->tracked = b->predicted < early ? early : b->predicted > late ? late : b->predicted;
+        b->tracking = 0;
+        b->precision = 0;
+        return;
+    }
+
+    /* The boundary moved out of the window, bisect after all */
+    latency = bisect_latency(b);
+    bisect_init(b, b->full, b->jitter);
+    b->latency = latency;
+}
+
+
+/* Process the response to a request sent at "at" */
+void bisect_sample(struct bisect *b, const struct timespec *at, const struct timespec *received, long long date) {
+    /* rtt contains round trip time in nanoseconds */
+    b->rtt = (received->tv_sec - at->tv_sec) * HTP_NS + received->tv_nsec - at->tv_nsec;
+    if (b->jitter) htp_rtt_update(b->jitter, b->rtt);
+
+    if (b->tracking) {
+        bisect_track(b, at, date);
+        return;
+    }
+
+    /* At the same time in a later second, a running clock gives the same offset */
+    if (b->verify) {
+        b->stale = received->tv_sec - date != b->first_offset;
+        b->when = b->verify;
+        b->verify = 0;
+        b->precision = 0;
+        return;
+    }
+
+    /* Obtain rtt/latency first */
+    if (b->latency == 0) {
+        b->latency = bisect_latency(b);
+        return;
+    }
+    b->latency = bisect_latency(b);
+
+    b->polls++;
+    b->offset = received->tv_sec - date;
+
+    b->nap >>= 1;
+    if (b->polls > 1) {
+        if (b->offset != b->prev_offset) {
+            b->nap = -b->nap;
+            b->ticked = 1;
+        }
+    } else {
+        b->first_offset = b->offset;
+    }
+    b->prev_offset = b->offset;
+
+    b->precision--;
+    b->when += b->nap;
+
+    /* A finer step would be lost in the jitter */
+    if (b->jitter && labs(b->nap) < b->jitter->rttvar) b->precision = 0;
+
+    /* No second boundary seen, make sure the clock runs */
+    if (b->precision == 0 && !b->ticked && b->polls > 1) {
+        b->verify = b->when;
+        b->when = b->start;
+        b->precision = 1;
+    }
+}
+
+
+/* The Date of a web server advances with the local clock, so the whole
+   seconds of the offset differ at most one between requests
+*/
+int bisect_stale(const struct bisect *b) {
+    return b->stale || (b->polls > 1 && llabs(b->offset - b->first_offset) > 1);
+}
+
+
+/* Return the time delta between web server time and system time */
+double bisect_result(const struct bisect *b) {
+    if (b->tracked != HTP_ERROR) return b->tracked;
+
+    if (b->when + b->nap == HTP_NS && b->offset == 0) return 0;
+
+    return (double)-b->first_offset + 1 - (double)b->when / HTP_NS;
+}
+
+
+/* Set up the bisection to probe either side of the predicted second
+   boundary, within the resolution of its precision (or the jitter), but
+   no closer than the last prediction error plus the round trip, so the
+   second probe can follow the response to the first in the same second.
+   Returns 0 when there is no (usable) prediction yet.
+*/
+int track_start(const struct htp_track *t, struct bisect *b, const struct timespec *now) {
+    double  elapsed, tick;
+
+    if (!t->valid || t->latency <= 0) return 0;
+
+    elapsed = (double)(now->tv_sec - t->at.tv_sec) + (double)(now->tv_nsec - t->at.tv_nsec) / 1e9;
+    b->predicted = t->offset + t->rate * elapsed;
+    b->half = HTP_NS >> (b->precision + 1);
+    if (b->jitter && b->half < b->jitter->rttvar) b->half = b->jitter->rttvar;
+    if (b->half < (long)(t->error * 1e9) + t->rtt) b->half = (long)(t->error * 1e9) + t->rtt;
+    if (b->half > HTP_NS / 4) return 0;
+    b->full = b->precision;
+    b->latency = t->latency;
+
+    /* The web server clock ticks where the local time plus the offset is a whole second */
+    tick = -b->predicted - (double)(long long)-b->predicted;
+    if (tick < 0) tick += 1;
+    b->when = (long)(tick * HTP_NS) - b->half;
+    b->tracking = HTP_TRACK_PROBES;
+    return 1;
+}
+
+
+void track_update(struct htp_track *t, const struct timespec *now, double offset, long latency, long rtt) {
+    double  elapsed, rate;
+
+    t->error = 0;
+    if (t->valid) {
+        elapsed = (double)(now->tv_sec - t->at.tv_sec) + (double)(now->tv_nsec - t->at.tv_nsec) / 1e9;
+        t->error = fabs(offset - t->offset - t->rate * elapsed);
+        if (elapsed >= HTP_TRACK_INTERVAL) {
+            rate = (offset - t->offset) / elapsed;
+            t->rate = t->rate == 0 ? rate : (t->rate + rate) / 2;
+        }
+    }
+    t->valid = 1;
+    t->at = *now;
+    t->offset = offset;
+    t->latency = latency;
+    t->rtt = rtt;
+}
+
+
+/* The local clock was changed by delta seconds */
+void track_shift(struct htp_track *t, double delta) {
+    t->offset -= delta;
+}
+
+
+/* Run a complete bisection against one web server, tracking its
+   second boundary across calls when track isn't NULL
+*/
+double htp_bisect(struct bisect *b, int precision, struct htp_rtt *jitter, struct htp_track *track,
+    const struct htp_ops *ops, void *arg) {
+    struct timespec     now, at;
+    struct htp_sample   sample;
+    double              offset;
+
+    bisect_init(b, precision, jitter);
+    if (track) {
+        ops->gettime(arg, &now);
+        track_start(track, b, &now);
+    }
+    while (b->precision >= 1) {
+        /* Wait till we reach the desired time, "when" */
+        ops->gettime(arg, &now);
+        bisect_schedule(b, &now, &at);
+        ops->sleep(arg, &at);
+
+        sample.at = at;
+        switch (ops->probe(arg, b, &sample)) {
+            case HTP_PROBE_DATE:
+                bisect_sample(b, &at, &sample.received, sample.date);
+                break;
+            case HTP_PROBE_HIRES:
+                return sample.offset;
+            case HTP_PROBE_RETRY:
+                break;
+            default:
+                return HTP_ERROR;
+        }
+    }
+
+    offset = bisect_result(b);
+    if (track && !bisect_stale(b)) {
+        ops->gettime(arg, &now);
+        track_update(track, &now, offset, bisect_latency(b), b->rtt);
+    }
+    return offset;
+}
+
+
+/* Insertion sort is more efficient (and smaller) than qsort for small lists */
+static void insertsort(double a[], int length) {
+    long i, j;
+
+    for (i = 1; i < length; i++) {
+        double value = a[i];
+        for (j = i - 1; j >= 0 && a[j] > value; j--)
+            a[j+1] = a[j];
+        a[j+1] = value;
+    }
+}
+
+
+/* Sort the time offsets and sum the ones close to the median (mean).
+   An offset which is more than half a second off from the median is
+   considered a 'false ticker', NTP synced web servers can never be more
+   off than a second. Returns the number of offsets summed.
+*/
+int htp_select(double timedelta[], int n, double *mean, double *sum) {
+    int i, good = 0;
+
+    insertsort(timedelta, n);
+    *mean = n ? timedelta[n/2] : 0;
+    *sum = 0;
+
+    for (i = 0; i < n; i++) {
+        if ((timedelta[i] - *mean) < .5 && (timedelta[i] - *mean) > -.5) {
+            *sum += timedelta[i];
+            good++;
+        }
+    }
+
+    return good;
+}
+
+
+/* Check whether k of the time offsets agree within the tolerance,
+   the offsets are sorted in place
+*/
+int htp_quorum(double timedelta[], int n, int k, double tolerance) {
+    int i;
+
+    insertsort(timedelta, n);
+    for (i = 0; i + k <= n; i++) {
+        if (timedelta[i + k - 1] - timedelta[i] <= tolerance) return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * HTTP Time Protocol, selection of time offsets
+ */
+
+#ifndef HTP_H
+#define HTP_H
+
+#include <float.h>
+
+#define HTP_NS              1000000000L
+#define HTP_ERROR           DBL_MAX         /* No time offset */
+#define HTP_MAX_PRECISION   9
+#define HTP_TRACK_PROBES    2               /* Requests around the predicted boundary */
+
+int htp_select(double timedelta[], int n, double *mean, double *sum);
+int htp_quorum(double timedelta[], int n, int k, double tolerance);
+
+#endif
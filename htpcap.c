@@ -0,0 +1,71 @@
+/*
+    htpcap - convert a htpdate capture file (-w) to CSV
+
+    Example usage:
+
+      htpcap /var/log/htpdate.cap > htpdate.csv
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+    http://www.gnu.org/copyleft/gpl.html
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "capture.h"
+
+
+/* Nanoseconds as seconds with 9 decimals */
+static void printns(int64_t ns, char sep) {
+    if (ns < 0) {
+        putchar('-');
+        ns = -ns;
+    }
+    printf("%" PRId64 ".%09" PRId64 "%c", ns / 1000000000, ns % 1000000000, sep);
+}
+
+
+int main(int argc, char *argv[]) {
+    struct capture_record   r;
+    char                    magic[CAPTURE_MAGICSIZE];
+    FILE                    *fp = stdin;
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+        puts("Usage: htpcap [capturefile]");
+        exit(argc == 2 ? 0 : 1);
+    }
+
+    if (argc == 2 && strcmp(argv[1], "-") != 0 && (fp = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "Error opening %s\n", argv[1]);
+        exit(1);
+    }
+
+    if (fread(magic, CAPTURE_MAGICSIZE, 1, fp) != 1 ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGICSIZE) != 0) {
+        fputs("Not a htpdate capture file\n", stderr);
+        exit(1);
+    }
+
+    puts("server,step,when,nap,launch,sent,received,rtt,date,offset");
+    while (capture_read(fp, &r)) {
+        printf("%" PRIu32 ",%" PRId32 ",%" PRId32 ",%" PRId32 ",",
+            r.server, r.step, r.when, r.nap);
+        printns(r.launch, ',');
+        printns(r.sent, ',');
+        printns(r.received, ',');
+        printns(r.rtt, ',');
+        printf("%" PRId64 ",", r.date);
+        if (r.offset == CAPTURE_NONE)
+            putchar('\n');
+        else
+            printns(r.offset, '\n');
+    }
+
+    exit(0);
+}
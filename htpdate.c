@@ -39,12 +39,10 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <netdb.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/timex.h>
+#include <sys/resource.h>
 #include <syslog.h>
 #include <stdarg.h>
 #include <limits.h>
@@ -52,17 +50,22 @@
 #include <pwd.h>
 #include <grp.h>
 #include <float.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/mman.h>
 
-#include "base64.h"
+#include "libhtpdate.h"
+#include "capture.h"
+#include "serve.h"
 
 #if defined __NetBSD__ || defined __FreeBSD__ || defined __APPLE__
 #define adjtimex ntp_adjtime
 #endif
 
-#ifdef ENABLE_HTTPS
-#include <openssl/ssl.h>
-#endif
-
 #define LICENSE "\
 Copyright (C) 2004-2026 Eddy Vervest.\n\
 \n\
@@ -73,24 +76,27 @@ your option) any later version.\n\
 \n\
 There is NO WARRANTY, to the extent permitted by law."
 
-#define VERSION                  "2.0.2"
+#define VERSION                  HTP_VERSION
 #define MAX_HTTP_HOSTS           16                /* 16 web servers */
-#define DEFAULT_HTTP_PORT        "80"
-#define DEFAULT_PROXY_PORT       "8080"
-#define DEFAULT_IP_VERSION       PF_UNSPEC         /* IPv6 and IPv4 */
-#define DEFAULT_HTTP_VERSION     "1"               /* HTTP/1.1 */
+#define MAX_ADDRESSES            16                /* per web server, -E */
 #define DEFAULT_TIME_LIMIT       31536000          /* 1 year */
 #define NO_TIME_LIMIT            -1
-#define ERR_TIMESTAMP            DBL_MAX          /* Err fetching date in getHTTPdate */
-#define DEFAULT_PRECISION        4                 /* 4 request per host */
+#define ERR_TIMESTAMP            HTP_ERROR        /* Err fetching date */
+#define DEFAULT_TOLERANCE        500               /* quorum, ms */
+#define QUORUM_MISSED            100               /* exit status + servers used */
+#define AUTO_PRECISION           0                 /* per host, from rtt jitter */
 #define DEFAULT_MIN_SLEEP        900               /* 15 minutes */
 #define DEFAULT_MAX_SLEEP        115200            /* 32 hours */
 #define MAX_DRIFT                32768000          /* 500 PPM */
+#define PLL_MAX_OFFSET           0.128             /* larger offsets are slewed */
+#define PLL_MAX_TC               10                /* kernel time constant */
+#define PLL_BACKOFF              4                 /* poll less often within 4x the error */
+#define PLL_MIN_ERROR            0.005             /* s, floor of the estimated error */
+#define HOLDOVER_WANDER          1e-6              /* frequency uncertainty, s/s */
+#define HOLDOVER_MAX_AGING       1e-10             /* change of drift, s/s per s */
+#define DEFAULT_SCAN_BUDGET      64                /* concurrent connections */
 #define DEFAULT_PID_FILE         "/var/run/htpdate.pid"
-#define HEADREQUESTSIZE          1024
-#define URLSIZE                  128
-#define BUFFERSIZE               8192
-#define PRINTBUFFERSIZE          BUFFERSIZE
+#define PRINTBUFFERSIZE          8192
 
 #define sign(x) (x < 0 ? (-1) : 1)
 
@@ -98,20 +104,6 @@ There is NO WARRANTY, to the extent permitted by law."
 /* By default turn off "debug" and "log" mode  */
 static int debug   = 0;
 static int logmode = 0;
-static int verifycert = 0;
-
-
-/* Insertion sort is more efficient (and smaller) than qsort for small lists */
-static void insertsort(double a[], int length) {
-    long i, j;
-
-    for (i = 1; i < length; i++) {
-        double value = a[i];
-        for (j = i - 1; j >= 0 && a[j] > value; j--)
-            a[j+1] = a[j];
-        a[j+1] = value;
-    }
-}
 
 
 /* Printlog is a slighty modified version from the one used in rdate */
@@ -140,425 +132,211 @@ static void printlog(int is_error, char *format, ...) {
 }
 
 
-/* Split argument in hostname/IP-address and TCP port
-   Supports IPv6 literal addresses, RFC 2732.
-*/
-static void splitURL(char **scheme, char **host, char **port, char **path, char **auth) {
-    char *rb, *rc, *lb, *lc, *ps, *basic_auth;
-
-    *path = "";
-    *scheme = NULL;
-
-    if ((ps = strcasestr(*host, "https://")) != NULL) {
-        #ifndef ENABLE_HTTPS
-        printlog(1, "HTTPS not supported, %s", *host);
-        return;
-        #endif
-        *scheme = "https://";
-        *port = "443";
-        *host = ps + 8;
-    }
-
-    if ((ps = strcasestr(*host, "http://")) != NULL) {
-        *host = ps + 7;
-    }
-
-    basic_auth = strchr(*host, '@');
-    /* Extract user:pass combo */
-    if (basic_auth != NULL) {
-        basic_auth[0] = '\0';
-        *auth = *host;
-        *host = basic_auth + 1;
-    }
-
-
-    lb = strchr(*host, '[');
-    rb = strrchr(*host, ']');
-    lc = strchr(*host, ':');
-    rc = strrchr(*host, ':');
-    ps = strchr(*host, '/');
-
-    /* Extract URL path */
-    if (ps != NULL) {
-        ps[0] = '\0';
-        *path = ps + 1;
-    }
-
-    /* A (literal) IPv6 address with portnumber */
-    if (rb < rc && lb != NULL && rb != NULL) {
-        rb[0] = '\0';
-        *port = rc + 1;
-        *host = lb + 1;
-        return;
-    }
-
-    /* A (literal) IPv6 address without portnumber */
-    if (rb != NULL && lb != NULL) {
-        rb[0] = '\0';
-        *host = lb + 1;
-        return;
-    }
-
-    /* A IPv4 address or hostname with portnumber */
-    if (rc != NULL && lc == rc) {
-        rc[0] = '\0';
-        *port = rc + 1;
-        return;
-    }
-}
-
-
-static void swuid(unsigned int id) {
-    if (seteuid(id)) {
-        printlog(1, "seteuid() %i", id);
-        exit(1);
-    }
+/* Log messages of the library */
+static void liblog(void *arg, int is_error, const char *message) {
+    printlog(is_error, "%s", (char *)message);
 }
 
 
-static void swgid(unsigned int id) {
-    if (setegid(id)) {
-        printlog(1, "setegid() %i", id);
-        exit(1);
-    }
+/* Memory use of the last poll cycle, for -d */
+static void printmemory(const struct htp_ctx *ctx) {
+    struct htp_memory   m;
+    struct rusage       ru;
+
+    htp_memory(ctx, &m);
+    getrusage(RUSAGE_SELF, &ru);
+    if (m.arena)
+        printlog(0, "Arena: %zu of %zu bytes (peak %zu), %lu allocations, %lu failed",
+            m.used, m.arena, m.peak, m.allocs, m.failed);
+    #if defined __GLIBC__ && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    printlog(0, "Heap: %zu bytes in use, OpenSSL %lu allocations, peak RSS %ld kB",
+        mallinfo2().uordblks, m.tlsallocs, ru.ru_maxrss);
+    #else
+    printlog(0, "Heap: OpenSSL %lu allocations, peak RSS %ld kB", m.tlsallocs, ru.ru_maxrss);
+    #endif
 }
 
 
-static long long getoffset(char remote_time[25]) {
-    struct timeval  timevalue = {0, 0};
-    struct timespec now;
-    struct tm       tm;
-
-    clock_gettime(CLOCK_REALTIME, &now);
-    memset(&tm, 0, sizeof(struct tm));
-    if (strptime(remote_time, "%d %b %Y %T", &tm) != NULL) {
-        timevalue.tv_sec = timegm(&tm);
-    } else {
-        printlog(1, "unknown time format");
-    }
-    return now.tv_sec - timevalue.tv_sec;
+/* In scan mode errors are part of the output, only shown in debug mode */
+static void scanlog(void *arg, int is_error, const char *message) {
+    if (debug) printlog(is_error, "%s", (char *)message);
 }
 
 
-static int sendHEAD(int server_s, char *headrequest, char *buffer) {
-    int ret = (int)send(server_s, headrequest, strlen(headrequest), 0);
-
-    if (ret < 0) {
-        printlog(1, "Error sending");
-        return -1;
+/* Print a CSV field or JSON string */
+static void printfield(const char *s, int json) {
+    if (!json && strpbrk(s, ",\"\r\n") == NULL) {
+        fputs(s, stdout);
+        return;
     }
 
-    int bytes_read = 0, n;
-    while (bytes_read < BUFFERSIZE - 1) {
-        /* Receive data from the web server
-           The return code from recv() is the number of bytes received
-        */
-        n = recv(server_s, buffer + bytes_read, BUFFERSIZE - 1 - bytes_read, 0);
-        if (n <= 0) break;
-        bytes_read += n;
-        buffer[bytes_read] = '\0';
-        if (strstr(buffer, "\r\n\r\n")) break;  /* end of HTTP headers */
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"')
+            fputs(json ? "\\\"" : "\"\"", stdout);
+        else if (json && *s == '\\')
+            fputs("\\\\", stdout);
+        else if (json && (unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
     }
-
-    return bytes_read > 0;
+    putchar('"');
 }
 
 
-#ifdef ENABLE_HTTPS
-static int sendHEADTLS(SSL *conn, char *headrequest, char *buffer) {
-    int ret = SSL_write(conn, headrequest, strlen(headrequest));
+/* One line per target, in order of completion */
+static void printscan(const char *target, const struct htp_result *result, int json) {
+    const char *error = result ? htp_strerror(result->status) : "invalid URL";
+    int        ok = result && result->status == HTP_OK;
 
-    if (ret < 0) {
-        printlog(1, "Error sending: %i", ret);
-        return -1;
-    }
-
-    int bytes_read = 0, n;
-    while (bytes_read < BUFFERSIZE - 1) {
-        n = SSL_read(conn, buffer + bytes_read, BUFFERSIZE - 1 - bytes_read);
-        if (n <= 0) break;
-        bytes_read += n;
-        buffer[bytes_read] = '\0';
-        if (strstr(buffer, "\r\n\r\n")) break;  /* end of HTTP headers */
+    if (json) {
+        fputs("{\"target\":", stdout);
+        printfield(target, 1);
+        if (ok)
+            printf(",\"offset\":%.6f,\"rtt\":%.6f,\"requests\":%d,\"error\":null}\n",
+                result->offset, result->rtt, result->requests);
+        else
+            printf(",\"offset\":null,\"rtt\":null,\"requests\":%d,\"error\":\"%s\"}\n",
+                result ? result->requests : 0, error);
+    } else {
+        printfield(target, 0);
+        if (ok)
+            printf(",%.6f,%.6f,%d,\n", result->offset, result->rtt, result->requests);
+        else
+            printf(",,,%d,%s\n", result ? result->requests : 0, error);
     }
-
-    return bytes_read > 0;
+    fflush(stdout);
 }
 
 
-static int proxyCONNECT(
-    int server_s,
-    char *host, char *port,
-    char *proxy, char *proxyport,
-    char *httpversion) {
+struct scan {
+    char    **targets;
+    int     json;
+    int     good;
+};
 
-    char buffer[BUFFERSIZE] = {'\0'};
-    char connectrequest[URLSIZE] = {'\0'};
 
-    snprintf(connectrequest, URLSIZE,
-       "CONNECT %s:%s HTTP/1.%s\r\n\r\n", host, port, httpversion);
+static void scandone(void *arg, int source, const struct htp_result *result) {
+    struct scan *scan = arg;
 
-    send(server_s, connectrequest, strlen(connectrequest), 0);
-    int ret = recv(server_s, buffer, BUFFERSIZE - 1, 0) > 0;
-    if (strstr(buffer, " 200 ") == NULL) {
-        printlog(1, "Proxy error: %s:%s\r\n%s", proxy, proxyport, buffer);
-    }
-    return ret;
+    if (result->status == HTP_OK) scan->good++;
+    printscan(scan->targets[source], result, scan->json);
 }
-#endif
 
 
-static double getHTTPdate(
-    char *scheme,
-    char *host, char *port, char *path, char *auth,
-    char *proxy, char *proxyport, char *proxyauth,
-    char *httpversion, int ipversion, int precision) {
-
-    int                 server_s;
-    int                 rc;
-    int                 polls = 0;
-    struct addrinfo     hints, *res;
-    struct timespec     sleepspec, now;
-    char                headrequest[HEADREQUESTSIZE] = {'\0'};
-    char                buffer[BUFFERSIZE] = {'\0'};
-    char                url[URLSIZE] = {'\0'};
-    char                *pdate = NULL;
-    char                auth_header[HEADREQUESTSIZE] = {'\0'};
-    char                *auth_buffer = NULL;
-    char                *proxy_auth_buffer = NULL;
-
-    /* Connect to web server via proxy server or directly */
-    memset(&hints, 0, sizeof(hints));
-    switch(ipversion) {
-        case 4:                     /* IPv4 only */
-            hints.ai_family = AF_INET;
-            break;
-        case 6:                     /* IPv6 only */
-            hints.ai_family = AF_INET6;
-            break;
-        default:                    /* Support IPv6 and IPv4 name resolution */
-            hints.ai_family = PF_UNSPEC;
+/* Measure the time offsets of many web servers, concurrently within a
+   connection budget, without touching the local clock. Targets are read
+   one per line, empty lines and # comments are skipped.
+*/
+static int scan(struct htp_options *opt, const char *targetfile, int budget, int json) {
+    FILE            *fp;
+    struct scan     scan = {NULL, json, 0};
+    struct htp_ctx  *ctx;
+    struct rlimit   rl;
+    char            *line = NULL, *target, **targets;
+    size_t          size = 0;
+    int             n = 0, total = 0, i;
+
+    fp = strcmp(targetfile, "-") ? fopen(targetfile, "r") : stdin;
+    if (fp == NULL) {
+        printlog(1, "Cannot open %s", targetfile);
+        return 1;
     }
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_CANONNAME;
 
-    if (proxy == NULL) {
-        rc = getaddrinfo(host, port, &hints, &res);
-    } else {
-        snprintf(url, URLSIZE, "http://%s:%s", host, port);
-        rc = getaddrinfo(proxy, proxyport, &hints, &res);
+    /* Every connection takes a file descriptor */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)budget + 16) {
+        rl.rlim_cur = rl.rlim_max < (rlim_t)budget + 16 ? rl.rlim_max : (rlim_t)budget + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)budget + 16) budget = (int)rl.rlim_cur - 16;
+        if (debug) printlog(0, "Connection budget %d", budget);
     }
 
-    /* Was the hostname and service resolvable? */
-    if (rc) {
-        printlog(1, "%s host or service unavailable", host);
-        return(ERR_TIMESTAMP);
+    opt->maxactive = budget;
+    opt->log = scanlog;
+    opt->done = scandone;
+    opt->donearg = &scan;
+    if ((ctx = htp_new(opt)) == NULL) {
+        printlog(1, "Initialization failed");
+        return 1;
     }
 
-    /*
-     * Build the basic auth header
-     * */
-    if (auth != NULL) {
-        auth_buffer = (char*) base64_encode((unsigned char*) auth, strlen(auth), NULL);
-        if (auth_buffer == NULL) {
-            printlog(1, "Error encoding base64 for auth to %s", host);
-            return(ERR_TIMESTAMP);
-        }
+    if (!json) puts("target,offset,rtt,requests,error");
 
-        if (proxyauth != NULL) {
-            proxy_auth_buffer = (char*) base64_encode((unsigned char*) proxyauth, strlen(proxyauth), NULL);
-            if (proxy_auth_buffer == NULL) {
-                printlog(1, "Error encoding base64 for auth to proxy %s", proxy);
-                return(ERR_TIMESTAMP);
-            }
-            snprintf(
-                auth_header,
-                HEADREQUESTSIZE,
-                "Authorization: Basic %s\r\n"
-                "Proxy-Authentication: Basic %s\r\n",
-                auth_buffer, proxy_auth_buffer
-            );
-            free(auth_buffer);
-            auth_buffer = NULL;
-            free(proxy_auth_buffer);
-            proxy_auth_buffer = NULL;
+    while (getline(&line, &size, fp) != -1) {
+        target = line + strspn(line, " \t");
+        target[strcspn(target, " \t\r\n")] = '\0';
+        if (*target == '\0' || *target == '#') continue;
 
-        } else {
-            snprintf(auth_header, HEADREQUESTSIZE, "Authorization: Basic %s\r\n", auth_buffer);
-            free(auth_buffer);
-            auth_buffer = NULL;
+        if (n == total) {
+            total = total ? total * 2 : 256;
+            if ((targets = realloc(scan.targets, (size_t)total * sizeof(char *))) == NULL) {
+                printlog(1, "Out of memory");
+                return 1;
+            }
+            scan.targets = targets;
         }
-    }
-
-
-    /* Build a combined HTTP/1.0 and 1.1 HEAD request
-       Pragma: no-cache, "forces" an HTTP/1.0 and 1.1 compliant
-       web server to return a fresh timestamp
-       Connection: keep-alive, for multiple requests
-    */
-    snprintf(headrequest, HEADREQUESTSIZE,
-        "HEAD %s/%s HTTP/1.%s\r\n"
-        "Host: %s\r\n"
-        "User-Agent: htpdate/"VERSION"\r\n"
-        "Pragma: no-cache\r\n"
-        "Cache-Control: no-cache\r\n"
-        "Connection: keep-alive\r\n"
-        "%s"
-        "\r\n",
-        url, path, httpversion, host, auth_header);
-
-
-    /* Loop through the available canonical names */
-    do {
-        server_s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (server_s < 0) {
-            continue;
+        if ((scan.targets[n] = strdup(target)) == NULL) {
+            printlog(1, "Out of memory");
+            return 1;
         }
-
-        rc = connect(server_s, res->ai_addr, res->ai_addrlen);
-        if (rc) {
-            close(server_s);
-            server_s = -1;
+        if (htp_add_source(ctx, target) < 0) {
+            printscan(target, NULL, json);
+            free(scan.targets[n]);
             continue;
         }
-
-        break;
-    } while ((res = res->ai_next));
-
-    freeaddrinfo(res);
-
-    if (rc) {
-        printlog(1, "%s connection failed", host);
-        return(ERR_TIMESTAMP);
+        n++;
     }
+    free(line);
+    if (fp != stdin) fclose(fp);
 
-    #ifdef ENABLE_HTTPS
-    SSL_CTX *tls_ctx = SSL_CTX_new(TLS_method());
-    SSL_CTX_set_default_verify_paths(tls_ctx);
-    SSL_CTX_set_verify_depth(tls_ctx, 4);
-    if (verifycert) SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
-    SSL *conn = SSL_new(tls_ctx);
-    SSL_set_tlsext_host_name(conn, host);
-    if (scheme) {
-        if (proxy) {
-            rc = proxyCONNECT(server_s, host, port, proxy, proxyport, httpversion);
-            if (rc != 1) {
-                printlog(1, "Proxy error: %i", rc);
-                return(ERR_TIMESTAMP);
-            }
-        }
-        if (! SSL_set_fd(conn, server_s)) {
-            printlog(1, "TLS error1");
-            return(ERR_TIMESTAMP);
-        } else {
-           if (SSL_connect(conn) != 1) {
-               printlog(1, "TLS error2");
-               return(ERR_TIMESTAMP);
-           }
-        }
+    htp_run(ctx);
+    if (debug) {
+        htp_histogram(ctx);
+        printmemory(ctx);
     }
-    #endif
+    htp_free(ctx);
 
-    long long offset = 0, first_offset = 0, prev_offset = 0;
-    long nap = 1000000000;
-    long latency = 0;
-    long when = nap >> precision;
-    do {
-        if (debug > 1)
-            printlog(0, "bisect: %i, when: %09li", polls, when);
+    for (i = 0; i < n; i++) free(scan.targets[i]);
+    free(scan.targets);
 
-        /* Initialize timer */
-        clock_gettime(CLOCK_REALTIME, &now);
-
-        /* Initialize RTT (start of measurement) */
-        long rtt = now.tv_sec;
-
-        /* Wait till we reach the desired time, "when" */
-        sleepspec.tv_sec = 0;
-        if (when - latency >= now.tv_nsec) {
-            sleepspec.tv_nsec = when - now.tv_nsec - latency;
-        } else {
-            sleepspec.tv_nsec = 1000000000 + when - now.tv_nsec - latency;
-            rtt++;
-        }
-
-        nanosleep(&sleepspec, NULL);
-
-        /* Send HEAD request */
-        #ifdef ENABLE_HTTPS
-        if (scheme)
-            rc = sendHEADTLS(conn, headrequest, buffer);
-        else
-        #endif
-            rc = sendHEAD(server_s, headrequest, buffer);
-
-        if (!rc) {
-            printlog(1, "error from %s:%s", host, port );
-            offset = LLONG_MAX;
-            break;
-        } else {
-            clock_gettime(CLOCK_REALTIME, &now);
+    return n && scan.good ? 0 : 1;
+}
 
-            /* rtt contains round trip time in nanoseconds */
-            rtt = (now.tv_sec - rtt) * 1000000000 + now.tv_nsec - when + latency;
 
-             /* Obtain rtt/latency first */
-            if (latency == 0) {
-                latency = rtt / 2;
-                continue;
-            }
-            latency = rtt / 2;
+static void swuid(unsigned int id) {
+    if (seteuid(id)) {
+        printlog(1, "seteuid() %i", id);
+        exit(1);
+    }
+}
 
-            /* Look for the line that contains [dD]ate: */
-            if ((pdate = strcasestr(buffer, "date: ")) != NULL && strlen(pdate) >= 35) {
 
-                if (debug > 2) printlog(0, "%s", buffer);
-                char remote_time[25] = {'\0'};
-                strncpy(remote_time, pdate + 11, 24);
+static void swgid(unsigned int id) {
+    if (setegid(id)) {
+        printlog(1, "setegid() %i", id);
+        exit(1);
+    }
+}
 
-                polls++;
-                offset = getoffset(remote_time);
 
-                nap >>= 1;
-                if (polls > 1) {
-                    if (offset != prev_offset) nap = -nap;
-                } else {
-                    first_offset=offset;
-                }
-                prev_offset=offset;
-                /* Print host, raw timestamp, round trip time */
-                if (debug)
-                    printlog(0, "%-25s %s, %s (%li ms) => %li", host, port,
-                    remote_time, rtt / (long)1e6, offset);
-            } else {
-                printlog(1, "%s no timestamp", host);
-                offset = LLONG_MAX;
-                break;
-            }
-        }                           /* bytes received */
-        precision--;
-        when += nap;
-    } while (precision >= 1);
-    close(server_s);
-
-    #ifdef ENABLE_HTTPS
-    if (scheme) SSL_shutdown(conn);
-    SSL_CTX_free(tls_ctx);
-    SSL_free(conn);
-    #endif
+/* Give up root for good, for the time server that faces the network;
+   the -u user or else nobody
+*/
+static void dropprivileges(unsigned int uid, unsigned int gid) {
+    struct passwd   *pw;
 
-    /* Rounding */
-    if (debug) printlog(0, "when: %ld, nap: %ld", when, nap);
-    if (offset == LLONG_MAX) return(ERR_TIMESTAMP);
-    if (when + nap == 1000000000 && offset == 0) return 0;
+    if (getuid() != 0) return;
+    if (uid == 0) {
+        pw = getpwnam("nobody");
+        uid = pw ? pw->pw_uid : 65534;
+        gid = pw ? pw->pw_gid : 65534;
+    }
 
-    /* Return the time delta between web server time (timevalue)
-       and system time (now)
-    */
-    if (first_offset < 0) {
-        return((double)-first_offset + (1000000000-(double)when)/1000000000);
-    } else {
-        return((double)-first_offset + 1 - ((double)when/1000000000));
+    swuid(0);
+    if (setgroups(0, NULL) || setresgid(gid, gid, gid) || setresuid(uid, uid, uid)) {
+        printlog(1, "Cannot drop privileges to %u:%u", uid, gid);
+        exit(1);
     }
 }
 
@@ -651,9 +429,22 @@ static int init_frequency(char *driftfile) {
 }
 
 
+static void write_frequency(char *driftfile, long freq) {
+    FILE    *fp;
+
+    fp = fopen(driftfile, "w");
+    if (fp != NULL) {
+        printlog(0, "Update %s", driftfile);
+        fprintf(fp, "%li", freq);
+        fclose(fp);
+    } else {
+        printlog(1, "Error writing frequency to %s", driftfile);
+    }
+}
+
+
 static int htpdate_adjtimex(double drift, char *driftfile, float confidence) {
     struct timex    tmx;
-    FILE            *fp;
 
     /* Read current clock frequency */
     tmx.modes = 0;
@@ -667,16 +458,85 @@ static int htpdate_adjtimex(double drift, char *driftfile, float confidence) {
     printlog(0, "Set frequency %li", tmx.freq);
     tmx.modes = MOD_FREQUENCY;
 
-    if (driftfile) {
-       fp = fopen(driftfile, "w");
-       if (fp != NULL) {
-           printlog(0, "Update %s", driftfile);
-           fprintf(fp, "%li", tmx.freq);
-           fclose(fp);
-       } else {
-           printlog(1, "Error writing frequency to %s", driftfile);
-       }
-    }
+    if (driftfile) write_frequency(driftfile, tmx.freq);
+
+    /* Become root */
+    swuid(0);
+    return(adjtimex(&tmx));
+}
+
+
+/* Hand the offset to the kernel PLL/FLL, which corrects time and
+   frequency continuously; the time constant follows the poll interval
+*/
+static int htpdate_pll(double offset, double esterror, unsigned int sleeptime, char *driftfile) {
+    struct timex    tmx = {0};
+    int             tc = 0, ret;
+
+    while ((1u << (tc + 1)) <= sleeptime && tc < PLL_MAX_TC) tc++;
+
+    printlog(0, "Kernel PLL %.3f ms, error %.3f ms, time constant %d", offset * 1e3, esterror * 1e3, tc);
+
+    /* Become root */
+    swuid(0);
+
+    /* Read the status first, only the PLL and synchronized bits are
+       ours; a pending leap second (STA_INS, STA_DEL) must stay
+    */
+    if ((ret = adjtimex(&tmx)) < 0) return(ret);
+
+    tmx.modes = MOD_OFFSET | MOD_NANO | MOD_TIMECONST | MOD_ESTERROR | MOD_MAXERROR | MOD_STATUS;
+    tmx.offset = (long)(offset * 1e9);
+    tmx.constant = tc;
+    tmx.esterror = (long)(esterror * 1e6);
+    tmx.maxerror = (long)((esterror + fabs(offset)) * 1e6);
+    tmx.status = (tmx.status | STA_PLL) & ~STA_UNSYNC;
+    if ((ret = adjtimex(&tmx)) < 0) return(ret);
+
+    if (debug) printlog(0, "Kernel frequency %.3f PPM", (double)tmx.freq / 65536);
+    if (driftfile) write_frequency(driftfile, tmx.freq);
+    return(ret);
+}
+
+
+/* Clock model for holdover (-H), learned while in sync: how fast the
+   local clock drifts and how fast that drift changes. Drift is the
+   offset rate with -a, and the kernel frequency with -x and -K.
+*/
+struct holdover {
+    time_t  synced;                 /* last good poll cycle, 0 before */
+    double  drift;                  /* s/s */
+    double  aging;                  /* s/s per s */
+    double  esterror;               /* s, at the last good poll cycle */
+    time_t  applied;                /* corrections applied up to */
+    int     holding;                /* since the last good poll cycle */
+};
+
+
+static double kernelfreq() {
+    struct timex    tmx = {0};
+
+    adjtimex(&tmx);
+    return (double)tmx.freq / 65536e6;
+}
+
+
+/* Offset the kernel PLL has yet to slew in, s */
+static double kerneloffset() {
+    struct timex    tmx = {0};
+
+    adjtimex(&tmx);
+    return (double)tmx.offset / (tmx.status & STA_NANO ? 1e9 : 1e6);
+}
+
+
+/* Estimated and maximum error of the clock, for other programs */
+static int seterror(double esterror, double maxerror) {
+    struct timex    tmx = {0};
+
+    tmx.modes = MOD_ESTERROR | MOD_MAXERROR;
+    tmx.esterror = (long)(esterror * 1e6);
+    tmx.maxerror = (long)(maxerror * 1e6);
 
     /* Become root */
     swuid(0);
@@ -684,35 +544,123 @@ static int htpdate_adjtimex(double drift, char *driftfile, float confidence) {
 }
 
 
+/* Offset the model predicts t seconds after the last good poll cycle */
+static double predict(const struct holdover *h, double t) {
+    return h->drift * t + h->aging * t * t / 2;
+}
+
+
+static double errorbound(const struct holdover *h, double t) {
+    return h->esterror + HOLDOVER_WANDER * t + fabs(h->aging) * t * t / 2;
+}
+
+
+/* A good poll cycle; after a holdover with -a the slewed prediction
+   is part of the drift
+*/
+static void holdover_learn(struct holdover *h, double drift, double esterror, int slewed) {
+    time_t  now = time(NULL);
+    double  aging;
+
+    if (slewed && h->applied > h->synced) drift += h->drift;
+    if (h->synced && now > h->synced) {
+        aging = (drift - h->drift) / (double)(now - h->synced);
+        if (fabs(aging) > HOLDOVER_MAX_AGING) aging = sign(aging) * HOLDOVER_MAX_AGING;
+        h->aging = (h->aging + aging) / 2;
+    }
+    h->drift = drift;
+    h->esterror = esterror;
+    h->synced = h->applied = now;
+}
+
+
+/* No time source, keep the clock on the course of the model: slew the
+   predicted offset with -a, follow the aging of the frequency with -x
+   and -K. The error bound grows with time.
+*/
+static void holdover_step(struct holdover *h, int setmode) {
+    time_t  now = time(NULL);
+    double  t = (double)(now - h->synced), done = (double)(h->applied - h->synced);
+    double  predicted, correction, bound = errorbound(h, t);
+
+    if (setmode < 3) {
+        predicted = predict(h, t);
+        correction = predicted - predict(h, done);
+        if (correction != 0 && setclock(correction, 1) < 0)
+            printlog(1, "Time change failed");
+    } else {
+        /* The kernel keeps the frequency, only its aging is left */
+        predicted = h->aging * t * t / 2;
+        if (h->aging != 0 && htpdate_adjtimex(h->aging * (t - done), NULL, 1) < 0)
+            printlog(1, "Frequency change failed");
+    }
+    h->applied = now;
+    h->holding = 1;
+
+    printlog(0, "Holdover %.0f s, predicted %.3f ms, error bound %.3f ms", t, predicted * 1e3, bound * 1e3);
+    if (seterror(bound, bound + fabs(predicted)) < 0)
+        printlog(1, "Error bound change failed");
+}
+
+
+/* Sleep until the next poll cycle. With -r the interval varies up to
+   1/8 either way, so hosts that started in step drift apart.
+*/
+static void pollsleep(unsigned int seconds, int spread) {
+    if (spread >= 0 && seconds >= 8)
+        seconds += (unsigned int)(random() % (seconds / 4 + 1)) - seconds / 8;
+    printlog(0, "Sleep %u s", seconds);
+    sleep(seconds);
+}
+
+
 static void showhelp() {
     puts("htpdate version "VERSION"\n\
-Usage: htpdate [-046acdhlnqstvxDF] [-f driftfile] [-i pidfile] [-m minpoll]\n\
-         [-M maxpoll] [-p precision] [-P <proxyserver>[:port]]\n\
-         [-u user[:group]] <URL> ...\n\n\
+Usage: htpdate [-0246acdhjklnqstvxDFHKT] [-A arena] [-b budget]\n\
+         [-C connections] [-E addresses] [-f driftfile] [-i pidfile]\n\
+         [-L targetfile] [-m minpoll] [-M maxpoll] [-p precision]\n\
+         [-P <proxyserver>[:port]] [-Q quorum[:tolerance]] [-r spread]\n\
+         [-S port] [-u user[:group]] [-w capturefile] <URL> ...\n\n\
   -0    HTTP/1.0 request\n\
+  -2    HTTP/2 request (https only, if supported by server)\n\
   -4    Force IPv4 name resolution only\n\
   -6    Force IPv6 name resolution only\n\
   -a    adjust time smoothly\n\
+  -A    per poll cycle memory from an arena of this many kB\n\
+  -b    requests per web server per hour\n\
   -c    verify server certificate\n\
+  -C    concurrent connections in scan mode (default 64)\n\
   -d    debug mode\n\
   -D    daemon mode\n\
+  -E    measure up to this many addresses of every web server (max. 16)\n\
   -f    drift/frequency file\n\
   -F    run daemon in foreground\n\
   -h    help\n\
+  -H    holdover, keep the clock on course while no web server is usable\n\
   -i    pidfile\n\
+  -j    JSON lines instead of CSV in scan mode\n\
+  -k    kernel TLS offload for https, if available\n\
+  -K    discipline time and frequency with the kernel PLL\n\
   -l    use syslog for output\n\
+  -L    scan the URLs in a file (- for stdin), report offsets only\n\
   -m    minimum poll interval\n\
   -M    maximum poll interval\n\
   -n    no proxy (ignore http_proxy environment variable)\n\
-  -p    precision (1..9, default 4)\n\
+  -p    precision (1..9 or auto, default 4)\n\
   -P    proxy server\n\
   -q    query only, don't make time changes (default)\n\
+  -Q    stop after quorum servers agree within tolerance ms (default 500)\n\
+  -r    start within this many seconds at random, randomize poll intervals\n\
   -s    set time\n\
+  -S    serve time on this port, with a high resolution X-Timestamp header\n\
   -t    turn off sanity time check\n\
+  -T    track the second boundary, full bisection only when it moved\n\
   -u    run daemon as user\n\
   -v    version\n\
+  -w    write every request to a binary capture file\n\
   -x    adjust system clock frequency\n\
-  URL   one of more URLs (max. 16), e.g. www.example.com\n");
+  URL   one of more URLs (max. 16), e.g. www.example.com\n\
+        optionally with #header[=s|ms|us|ns] for a high resolution timestamp\n");
 
     return;
 }
@@ -779,30 +727,42 @@ static void runasdaemon(char *pidfile) {
 }
 
 
+/* Exit status in one-shot mode with a quorum: 0 once it is reached,
+   otherwise QUORUM_MISSED plus the number of web servers used (capped)
+*/
+static int quorumstatus(int reached, int goodtimes) {
+    if (reached) return 0;
+    if (goodtimes > 255 - QUORUM_MISSED) goodtimes = 255 - QUORUM_MISSED;
+    return QUORUM_MISSED + goodtimes;
+}
+
+
 int main(int argc, char *argv[]) {
-    char            *host = NULL, *proxy = NULL, *proxyport = NULL;
-    char            *port = NULL;
-    char            *path = NULL;
-    char            *scheme = NULL;
-    char            *auth = NULL, *proxyauth = NULL;
-    char            *httpversion = DEFAULT_HTTP_VERSION;
+    char            *proxy = NULL;
     char            *pidfile = DEFAULT_PID_FILE;
     char            *user = NULL, *userstr = NULL, *group = NULL;
-    double          timeavg, drift = 0;
-    double          timedelta[MAX_HTTP_HOSTS-1];
+    double          timeavg, drift = 0, pllpending = 0, remaining;
+    double          timedelta[MAX_HTTP_HOSTS * MAX_ADDRESSES];
+    struct htp_options opt;
+    struct htp_ctx  *ctx;
+    const struct htp_result *result;
     int             numservers;
-    int             precision = DEFAULT_PRECISION;
+    int             expand = 1;
+    int             precision;
+    int             quorum = 0;
+    double          tolerance = DEFAULT_TOLERANCE / 1e3;
     int             setmode = 0;
+    int             reached = 0;
     int             i, param;
     int             daemonize = 0, foreground = 0;
     int             noproxyenv = 0;
-    int             ipversion = DEFAULT_IP_VERSION;
     long long       timelimit = DEFAULT_TIME_LIMIT;
     unsigned int    minsleep = DEFAULT_MIN_SLEEP;
     unsigned int    maxsleep = DEFAULT_MAX_SLEEP;
     unsigned int    sleeptime = minsleep;
     unsigned int    sw_gid = 0, sw_uid = 0;
     time_t          starttime = 0;
+    struct timespec now;
 
     struct passwd   *pw;
     struct group    *gr;
@@ -811,24 +771,46 @@ int main(int argc, char *argv[]) {
     extern int      optind;
 
     char            *driftfile = NULL;
+    char            *capturepath = NULL;
+    char            *targetfile = NULL;
+    int             budget = DEFAULT_SCAN_BUDGET, json = 0;
+    int             spread = -1;
+    int             hold = 0;
+    int             need;
+    struct holdover ho = {0};
+    char            *servport = NULL;
+    int             servfd = -1;
+    pid_t           pid, parent;
+    volatile int    *synced = NULL;
+
+    /* Before OpenSSL is used at all */
+    htp_count_tls();
+    htp_defaults(&opt);
+    precision = opt.precision;
 
     /* Parse the command line switches and arguments */
-    while ((param = getopt(argc, argv, "046acdf:hi:lm:np:qstu:vxDFM:P:")) != -1)
+    while ((param = getopt(argc, argv, "0246ab:cdf:hi:jklm:np:qr:stu:vw:xA:C:DE:FHKL:M:P:Q:S:T")) != -1)
     switch(param) {
         case '0':               /* HTTP/1.0 */
-            httpversion = "0";
+            opt.httpversion = 0;
+            break;
+        case '2':               /* HTTP/2 for https, if offered by server */
+            opt.http2 = 1;
+            break;
+        case 'k':               /* kernel TLS offload */
+            opt.ktls = 1;
             break;
         case '4':               /* IPv4 only */
-            ipversion = 4;
+            opt.ipversion = 4;
             break;
         case '6':               /* IPv6 only */
-            ipversion = 6;
+            opt.ipversion = 6;
             break;
         case 'a':               /* adjust time */
             setmode = 1;
             break;
         case 'c':               /* server certificate verification */
-            verifycert = 1;
+            opt.verifycert = 1;
             break;
         case 'd':               /* turn debug on */
             if (debug <= 3) debug++;
@@ -843,6 +825,9 @@ int main(int argc, char *argv[]) {
         case 'i':               /* pid file */
             pidfile = (char *)optarg;
             break;
+        case 'j':               /* scan output as JSON lines */
+            json = 1;
+            break;
         case 'l':               /* log mode */
             logmode = 1;
             openlog("htpdate",LOG_NDELAY||LOG_PID,LOG_DAEMON);
@@ -858,8 +843,12 @@ int main(int argc, char *argv[]) {
             noproxyenv = 1;
             break;
         case 'p':               /* precision */
+            if (strcmp(optarg, "auto") == 0) {
+                precision = AUTO_PRECISION;
+                break;
+            }
             precision = atoi(optarg) ;
-            if ((precision < 1) || (precision > 9)) {
+            if ((precision < 1) || (precision > HTP_MAX_PRECISION)) {
                 fputs("Invalid precision\n", stderr);
                 exit(1);
             }
@@ -898,10 +887,58 @@ int main(int argc, char *argv[]) {
         case 'v':               /* print version */
             puts("htpdate version "VERSION"\n"LICENSE"");
             exit(0);
+        case 'w':               /* capture file */
+            capturepath = (char *)optarg;
+            break;
         case 'x':               /* adjust time and clock frequency */
             setmode = 3;
             if (maxsleep > 14400) maxsleep = 14400;
-            if (precision < 7) precision = 7;
+            if (precision != AUTO_PRECISION && precision < 7) precision = 7;
+            break;
+        case 'K':               /* discipline time with the kernel PLL */
+            setmode = 4;
+            if (maxsleep > 14400) maxsleep = 14400;
+            break;
+        case 'H':               /* holdover when no time source is left */
+            hold = 1;
+            break;
+        case 'T':               /* probe around the predicted second boundary */
+            opt.tracking = 1;
+            break;
+        case 'b':               /* requests per web server per hour */
+            if ((opt.budget = atoi(optarg)) <= 0) {
+                fputs("Invalid request budget\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'r':               /* random start delay and poll intervals */
+            if ((spread = atoi(optarg)) < 0) {
+                fputs("Invalid spread\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'A':               /* per cycle memory from an arena, kB */
+            if (atoi(optarg) <= 0) {
+                fputs("Invalid arena size\n", stderr);
+                exit(1);
+            }
+            opt.arena = (size_t)atoi(optarg) * 1024;
+            break;
+        case 'E':               /* a source per address of a web server */
+            expand = atoi(optarg);
+            if (expand < 1 || expand > MAX_ADDRESSES) {
+                fputs("Invalid number of addresses\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'C':               /* scan connection budget */
+            if ((budget = atoi(optarg)) <= 0) {
+                fputs("Invalid connection budget\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'L':               /* scan the targets in a file, - for stdin */
+            targetfile = (char *)optarg;
             break;
         case 'D':               /* run as daemon */
             daemonize = 1;
@@ -917,18 +954,36 @@ int main(int argc, char *argv[]) {
                 exit(1);
             }
             break;
+        case 'Q':               /* quorum for one-shot mode */
+            quorum = atoi(optarg);
+            if (strchr(optarg, ':')) tolerance = atof(strchr(optarg, ':') + 1) / 1e3;
+            if (quorum < 1 || quorum > MAX_HTTP_HOSTS || tolerance <= 0) {
+                fputs("Invalid quorum\n", stderr);
+                exit(1);
+            }
+            break;
         case 'P':
-            proxyport = DEFAULT_PROXY_PORT;
-            char *proxywithport = strdup((char *)optarg);
-            proxy = proxywithport;
-            splitURL(&scheme, &proxy, &proxyport, &path, &proxyauth);
+            proxy = (char *)optarg;
+            break;
+        case 'S':               /* serve time on this port */
+            servport = (char *)optarg;
             break;
         default:
             exit(1);
     }
 
+    /* A budget that can't pay for a measurement would never recover,
+       automatic precision may take up to the maximum
+    */
+    need = (precision == AUTO_PRECISION ? HTP_MAX_PRECISION : precision) + 1;
+    if (opt.tracking) need += HTP_TRACK_PROBES;
+    if (opt.budget && opt.budget < need) {
+        fprintf(stderr, "Request budget too small, a measurement takes %d requests\n", need);
+        exit(1);
+    }
+
     /* Display help page, if no servers are specified */
-    if (argv[optind] == NULL) {
+    if (argv[optind] == NULL && targetfile == NULL && servport == NULL) {
         showhelp();
         exit(1);
     }
@@ -948,8 +1003,18 @@ int main(int argc, char *argv[]) {
         }
         if (debug) printlog(0, "Proxy: %s", proxy);
         proxy += 7;
-        proxyport = DEFAULT_PROXY_PORT;
-        splitURL(&scheme, &proxy, &proxyport, &path, &proxyauth);
+    }
+
+    /* Scan mode only reports, it never changes the time */
+    if (targetfile) {
+        if (capturepath && (opt.capture = capture_open(capturepath)) == NULL) {
+            printlog(1, "Cannot open capture file %s", capturepath);
+            exit(1);
+        }
+        opt.precision = precision;
+        opt.proxy = proxy;
+        opt.debug = debug;
+        exit(scan(&opt, targetfile, budget, json));
     }
 
     /* One must be "root" to change the system time */
@@ -958,6 +1023,24 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    /* Open the capture file before changing directory or user */
+    if (capturepath && (opt.capture = capture_open(capturepath)) == NULL) {
+        printlog(1, "Cannot open capture file %s", capturepath);
+        exit(1);
+    }
+
+    /* Listen before dropping privileges, a port below 1024 needs root */
+    if (servport) {
+        if (numservers && !(daemonize || foreground)) {
+            fputs("Serving time with URLs needs -D or -F\n", stderr);
+            exit(1);
+        }
+        if ((servfd = serve_open(servport, opt.ipversion)) < 0) {
+            printlog(1, "Cannot listen on port %s", servport);
+            exit(1);
+        }
+    }
+
     /* Run as a daemonize when -D is set */
     if (daemonize) {
         runasdaemon(pidfile);
@@ -973,9 +1056,68 @@ int main(int argc, char *argv[]) {
     if (sw_gid) swgid(sw_gid);
     if (sw_uid) swuid(sw_uid);
 
-    #ifdef ENABLE_HTTPS
-    SSL_library_init();
-    #endif
+    /* Serve time, from a child process when the daemon also keeps the
+       clock in sync
+    */
+    if (servfd >= 0) {
+        printlog(0, "Serving time on port %s", servport);
+        if (numservers == 0) {
+            dropprivileges(sw_uid, sw_gid);
+            exit(serve_run(servfd, NULL, liblog, NULL) ? 1 : 0);
+        }
+
+        /* Shared with the server, which answers 503 until a good poll cycle */
+        synced = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (synced == MAP_FAILED) {
+            printlog(1, "mmap()");
+            exit(1);
+        }
+        *synced = 0;
+        parent = getpid();
+        if ((pid = fork()) < 0) {
+            printlog(1, "fork()");
+            exit(1);
+        }
+        if (pid == 0) {
+            dropprivileges(sw_uid, sw_gid);
+            /* After the change of credentials, which clears it */
+            #ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            #endif
+            if (getppid() != parent) exit(0);
+            exit(serve_run(servfd, synced, liblog, NULL) ? 1 : 0);
+        }
+        close(servfd);
+    }
+
+    opt.precision = precision;
+    opt.proxy = proxy;
+    opt.debug = debug;
+    opt.log = liblog;
+    if ((ctx = htp_new(&opt)) == NULL) {
+        printlog(1, "Initialization failed");
+        exit(1);
+    }
+
+    /* Prepare the requests for all time sources (web servers), with -E
+       one for every address of a web server
+    */
+    for (i = 0; i < numservers; i++) {
+        if (htp_expand_source(ctx, argv[optind + i], expand) < 0)
+            exit(1);
+    }
+    numservers = htp_sources(ctx);
+
+    /* A fleet (re)started at the same moment shouldn't poll in step */
+    if (spread >= 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        srandom((unsigned int)(now.tv_nsec ^ now.tv_sec ^ getpid()));
+        if (spread > 0 && (daemonize || foreground)) {
+            i = (int)(random() % (spread + 1));
+            printlog(0, "Start in %d s", i);
+            sleep((unsigned int)i);
+        }
+    }
 
     /* Infinite poll cycle loop in daemonize or foreground mode */
     do {
@@ -983,21 +1125,41 @@ int main(int argc, char *argv[]) {
         /* Initialize number of received valid timestamps, good timestamps
            and the average of the good timestamps
         */
-        int    validtimes = 0, goodtimes = 0;
-        double sumtimes = 0, mean = 0;
+        int    validtimes = 0, goodtimes, running, newdrift = 0;
+        double sumtimes = 0, mean = 0, esterror = 0;
 
-        /* Loop through the time sources (web servers); poll cycle */
-        for (i = optind; i < argc; i++) {
+        /* The kernel PLL slews an offset in gradually, the predicted
+           second boundaries only move by the part applied so far
+        */
+        if (pllpending != 0) {
+            remaining = kerneloffset();
+            htp_adjusted(ctx, pllpending - remaining);
+            pllpending = remaining;
+        }
 
-            /* host:port is stored in argv[i] */
-            char *hostport = strdup(argv[i]);
-            host = hostport;
-            port = DEFAULT_HTTP_PORT;
-            splitURL(&scheme, &host, &port, &path, &auth);
+        /* Measure all time sources (web servers) at once; poll cycle */
+        htp_start(ctx);
+        while ((running = htp_step(ctx)) > 0) {
 
-            double offset = getHTTPdate(scheme, host, port, path, auth,
-                proxy, proxyport, proxyauth, httpversion, ipversion, precision);
-            free(hostport);
+            /* In one-shot mode, cancel the remaining servers once enough agree */
+            if (quorum && !(daemonize || foreground)) {
+                for (i = validtimes = 0; i < numservers; i++) {
+                    result = htp_result(ctx, i);
+                    if (result->status == HTP_OK && (timelimit == NO_TIME_LIMIT || fabs(result->offset) < timelimit))
+                        timedelta[validtimes++] = result->offset;
+                }
+                if (htp_quorum(timedelta, validtimes, quorum, tolerance)) {
+                    if (debug) printlog(0, "Quorum of %d reached, %d servers cancelled", quorum, running);
+                    htp_stop(ctx);
+                    break;
+                }
+            }
+
+            htp_wait(ctx);
+        }
+
+        for (i = validtimes = 0; i < numservers; i++) {
+            double offset = htp_result(ctx, i)->offset;
             if (debug && offset != ERR_TIMESTAMP) {
                 printlog(0, "offset: %.6f", offset);
             }
@@ -1009,28 +1171,74 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        /* Sort the timedelta results */
-        insertsort(timedelta, validtimes);
+        if (opt.capture) fflush(opt.capture);
+        if (debug) {
+            htp_histogram(ctx);
+            printmemory(ctx);
+        }
 
-        /* Mean time value */
-        mean = timedelta[validtimes/2];
+        /* Also when the last web server completed the quorum */
+        if (quorum) reached = htp_quorum(timedelta, validtimes, quorum, tolerance);
 
-        /* Filter out the bogus timevalues. A timedelta which is more than
-           1 second off from mean, is considered a 'false ticker'.
-           NTP synced web servers can never be more off than a second.
-        */
-        for (i = 0; i < validtimes; i++) {
-            if ((timedelta[i]-mean) < .5 && (timedelta[i]-mean) > -.5) {
-                sumtimes += timedelta[i];
-                goodtimes++;
-            }
-        }
+        /* Filter out the bogus timevalues (false tickers) */
+        goodtimes = htp_select(timedelta, validtimes, &mean, &sumtimes);
 
         /* Check if we have at least one valid response */
         if (goodtimes) {
 
             timeavg = sumtimes / goodtimes;
 
+            /* Estimated error, the mean deviation of the good offsets */
+            for (i = 0; i < validtimes; i++) {
+                if (fabs(timedelta[i] - mean) < .5)
+                    esterror += fabs(timedelta[i] - timeavg);
+            }
+            esterror /= goodtimes;
+
+            /* Back from holdover, the offset is corrected like any other,
+               never stepped
+            */
+            if (ho.holding) {
+                printlog(0, "Holdover of %ld s ended, offset %.3f ms, error bound %.3f ms",
+                    (long)(time(NULL) - ho.synced), timeavg * 1e3,
+                    errorbound(&ho, (double)(time(NULL) - ho.synced)) * 1e3);
+                ho.holding = 0;
+            }
+
+            /* The kernel PLL takes small offsets as they are, it has its
+               own loop filter
+            */
+            if (setmode == 4 && fabs(timeavg) < PLL_MAX_OFFSET) {
+                if (debug > 1)
+                    printlog(0, "#: %d, mean: %.3f, average: %.3f", goodtimes, mean, timeavg);
+
+                if (htpdate_pll(timeavg, esterror, sleeptime, driftfile) < 0)
+                    printlog(1, "Time change failed");
+                else
+                    pllpending = timeavg;
+                if (hold) holdover_learn(&ho, kernelfreq(), esterror, 0);
+                if (synced) *synced = 1;
+
+                /* Drop root privileges again */
+                if (sw_uid) swuid(sw_uid);
+
+                /* No need to wait for the correction, poll less often
+                   while the offset is within the noise, and catch up
+                   quickly when it isn't
+                */
+                if (fabs(timeavg) > PLL_BACKOFF * (esterror > PLL_MIN_ERROR ? esterror : PLL_MIN_ERROR))
+                    sleeptime = minsleep;
+                else if (sleeptime < maxsleep)
+                    sleeptime <<= 1;
+
+                if (daemonize || foreground) {
+                    pollsleep(sleeptime, spread);
+                } else if (quorum) {
+                    exit(quorumstatus(reached, goodtimes));
+                }
+                continue;
+            }
+
             /* Avoid bouncing between upper/lower limit when (almost) in sync */
             if (timeavg < 1 && timeavg > -1) timeavg /= 2;
 
@@ -1039,8 +1247,10 @@ int main(int argc, char *argv[]) {
 
             /* Do I really need to change the time?  */
             if (sumtimes || !(daemonize || foreground)) {
-                if (setclock(timeavg, setmode) < 0)
+                if (setclock(timeavg, setmode == 4 ? 1 : setmode) < 0)
                     printlog(1, "Time change failed");
+                else if (setmode)
+                    htp_adjusted(ctx, timeavg);
 
                 /* Drop root privileges again */
                 if (sw_uid) swuid(sw_uid);
@@ -1049,6 +1259,7 @@ int main(int argc, char *argv[]) {
                     if (starttime) {
                         /* Calculate systematic clock drift */
                         drift = timeavg / (double)(time(NULL) - starttime);
+                        newdrift = 1;
                         printlog(0, "Drift %.2f PPM, %.2f s/day", drift*1e6, drift*86400);
 
                         /* Adjust system clock */
@@ -1075,20 +1286,33 @@ int main(int argc, char *argv[]) {
                 if (sleeptime < maxsleep) sleeptime <<= 1;
                 if (setmode == 3) setstatus();
             }
+            /* With -a the drift is only known after a time adjustment */
+            if (hold && setmode >= 3)
+                holdover_learn(&ho, kernelfreq(), esterror, 0);
+            else if (hold && newdrift)
+                holdover_learn(&ho, drift, esterror, 1);
+            if (synced) *synced = 1;
 
             if (daemonize || foreground) {
-                printlog(0, "Sleep %ld s", sleeptime);
-                sleep(sleeptime);
+                pollsleep(sleeptime, spread);
+            } else if (quorum) {
+                exit(quorumstatus(reached, goodtimes));
             }
 
             /* After first successful poll cycle do not step through time, only adjust */
-            if (setmode != 3) setmode = 1;
+            if (setmode < 3) setmode = 1;
 
         } else {
             printlog(1, "No server suitable for synchronization found");
+            if (synced) *synced = 0;
             /* Sleep for minsleep to avoid flooding */
-            if (daemonize || foreground)
-                sleep(minsleep);
+            if (daemonize || foreground) {
+                if (hold && ho.synced) {
+                    holdover_step(&ho, setmode);
+                    if (sw_uid) swuid(sw_uid);
+                }
+                pollsleep(minsleep, spread);
+            }
             else
                 exit(1);
         }
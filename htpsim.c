@@ -0,0 +1,310 @@
+/*
+    htpsim - simulation of htpdate against virtual web servers
+
+    Runs the bisection and false ticker selection of htpdate against
+    virtual web servers in virtual time, so precision and poll settings
+    can be evaluated without waiting for real time to pass.
+
+    Each web server has a clock offset (skew) and frequency error (drift),
+    and is reached over a network path with a fixed round trip time, an
+    asymmetry between both directions and a random (exponential) queueing
+    delay (jitter) per direction. The local clock is the reference.
+
+    With -T, the second boundary of every web server is tracked across
+    poll cycles like htpdate -T does, and -e makes the simulation fail
+    when the error gets too large, e.g. for tracking drifting clocks:
+
+      htpsim -n 10000 -t 7 -p 7 -j 2 -a 0.2
+      htpsim -T -p 7 -r 40 -d 30 -e 10
+
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+    http://www.gnu.org/copyleft/gpl.html
+*/
+
+/* Needed for getopt with -std=c11 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "bisect.h"
+
+#define EPOCH                   1700000000LL       /* Start of virtual time */
+#define MAX_GROUP               16                 /* like MAX_HTTP_HOSTS */
+
+struct vserver {
+    double      skew;                   /* Clock offset at EPOCH, s */
+    double      drift;                  /* Frequency error */
+    struct htp_rtt rtt;                 /* for automatic precision */
+    struct htp_track track;             /* with -T */
+};
+
+struct world {
+    long long   now;                    /* Virtual time, ns */
+    uint64_t    random;
+    double      rtt;                    /* Round trip time, s */
+    double      jitter;                 /* Mean queueing delay, s */
+    double      asymmetry;              /* -1..1, share of rtt upstream */
+    long        requests;
+    struct vserver *server;             /* Server being probed */
+};
+
+struct stats {
+    double      *v;
+    long        n;
+};
+
+
+/* xorshift64*, reproducible on every platform */
+static double uniform(struct world *w) {
+    w->random ^= w->random >> 12;
+    w->random ^= w->random << 25;
+    w->random ^= w->random >> 27;
+    return (double)((w->random * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+
+static double exponential(struct world *w, double mean) {
+    return -mean * log(1 - uniform(w));
+}
+
+
+static void simtime(void *arg, struct timespec *now) {
+    struct world *w = arg;
+
+    now->tv_sec = (time_t)(w->now / HTP_NS);
+    now->tv_nsec = (long)(w->now % HTP_NS);
+}
+
+
+static void simsleep(void *arg, const struct timespec *until) {
+    struct world *w = arg;
+    long long t = (long long)until->tv_sec * HTP_NS + until->tv_nsec;
+
+    if (t > w->now) w->now = t;
+}
+
+
+/* Time offset of a web server clock at virtual time t */
+static double trueoffset(const struct vserver *s, long long t) {
+    return s->skew + s->drift * ((double)t / HTP_NS - (double)EPOCH);
+}
+
+
+static int simprobe(void *arg, const struct bisect *b, struct htp_sample *sample) {
+    struct world    *w = arg;
+    long long       arrival, remote;
+
+    simtime(w, &sample->sent);
+    w->requests++;
+
+    /* The Date header is taken when the request arrives */
+    arrival = w->now + (long long)((w->rtt / 2 * (1 + w->asymmetry) +
+        exponential(w, w->jitter)) * 1e9);
+    remote = arrival + (long long)(trueoffset(w->server, arrival) * 1e9);
+    sample->date = remote / HTP_NS - (remote % HTP_NS < 0);
+
+    w->now = arrival + (long long)((w->rtt / 2 * (1 - w->asymmetry) +
+        exponential(w, w->jitter)) * 1e9);
+    simtime(w, &sample->received);
+    return HTP_PROBE_DATE;
+}
+
+
+static const struct htp_ops simops = { simtime, simsleep, simprobe };
+
+
+static int compare(const void *a, const void *b) {
+    double x = fabs(*(const double *)a), y = fabs(*(const double *)b);
+    return (x > y) - (x < y);
+}
+
+
+static void report(const char *name, struct stats *st) {
+    double  sum = 0, sumsq = 0, mean;
+    long    i;
+
+    if (st->n == 0) {
+        printf("%-18s no results\n", name);
+        return;
+    }
+    for (i = 0; i < st->n; i++) {
+        sum += st->v[i];
+        sumsq += st->v[i] * st->v[i];
+    }
+    mean = sum / (double)st->n;
+
+    /* Percentiles of the absolute error */
+    qsort(st->v, (size_t)st->n, sizeof(double), compare);
+    printf("%-18s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+        mean * 1e3, sqrt(fabs(sumsq / (double)st->n - mean * mean)) * 1e3,
+        fabs(st->v[st->n / 2]) * 1e3, fabs(st->v[st->n * 9 / 10]) * 1e3,
+        fabs(st->v[st->n * 99 / 100]) * 1e3, fabs(st->v[st->n - 1]) * 1e3);
+}
+
+
+static void showhelp() {
+    puts("Usage: htpsim [-hT] [-a asymmetry] [-d drift] [-e maxerror] [-f falsetickers]\n\
+         [-i interval] [-j jitter] [-k servers] [-n servers] [-p precision]\n\
+         [-r rtt] [-s skew] [-S seed] [-t days]\n\n\
+  -a    network asymmetry, -1..1 (default 0)\n\
+  -d    maximum web server frequency error in PPM (default 0)\n\
+  -e    fail when the p99 error per web server exceeds this in ms\n\
+  -f    share of web servers with a wrong clock, 0..1 (default 0)\n\
+  -h    help\n\
+  -i    poll interval in seconds (default 3600)\n\
+  -j    mean queueing delay per direction in ms (default 1)\n\
+  -k    web servers per htpdate instance (default 4)\n\
+  -n    number of web servers (default 1000)\n\
+  -p    precision (1..9 or auto, default 4)\n\
+  -r    round trip time in ms (default 50)\n\
+  -s    maximum web server clock offset in ms (default 10)\n\
+  -S    random seed\n\
+  -t    simulated time in days (default 1)\n\
+  -T    track the second boundary of the web servers across poll cycles\n");
+}
+
+
+int main(int argc, char *argv[]) {
+    struct world    w = {0};
+    struct vserver  *servers;
+    struct bisect   b;
+    struct stats    single = {0}, combined = {0};
+    double          skew = .01, drift = 0, falsetickers = 0, days = 1, maxerror = 0;
+    double          timedelta[MAX_GROUP], mean, sum;
+    long            nservers = 1000, interval = 3600, cycles, c, i, g;
+    int             group = 4, precision = 4, tracking = 0, param, n, good;
+
+    w.rtt = .05;
+    w.jitter = .001;
+    w.random = 88172645463325252ULL;
+
+    while ((param = getopt(argc, argv, "a:d:e:f:hi:j:k:n:p:r:s:S:t:T")) != -1)
+    switch(param) {
+        case 'a':
+            w.asymmetry = atof(optarg);
+            break;
+        case 'd':
+            drift = atof(optarg) * 1e-6;
+            break;
+        case 'e':
+            maxerror = atof(optarg) * 1e-3;
+            break;
+        case 'f':
+            falsetickers = atof(optarg);
+            break;
+        case 'h':
+            showhelp();
+            exit(0);
+        case 'i':
+            interval = atol(optarg);
+            break;
+        case 'j':
+            w.jitter = atof(optarg) * 1e-3;
+            break;
+        case 'k':
+            group = atoi(optarg);
+            break;
+        case 'n':
+            nservers = atol(optarg);
+            break;
+        case 'p':
+            precision = strcmp(optarg, "auto") ? atoi(optarg) : 0;
+            break;
+        case 'r':
+            w.rtt = atof(optarg) * 1e-3;
+            break;
+        case 's':
+            skew = atof(optarg) * 1e-3;
+            break;
+        case 'S':
+            w.random = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 't':
+            days = atof(optarg);
+            break;
+        case 'T':
+            tracking = 1;
+            break;
+        default:
+            exit(1);
+    }
+
+    if (precision < 0 || precision > HTP_MAX_PRECISION || group < 1 || group > MAX_GROUP ||
+        nservers < 1 || interval < 1 || days <= 0 || w.asymmetry < -1 || w.asymmetry > 1) {
+        fputs("Invalid parameter\n", stderr);
+        exit(1);
+    }
+
+    cycles = (long)(days * 86400 / (double)interval);
+    if (cycles < 1) cycles = 1;
+
+    servers = calloc((size_t)nservers, sizeof(struct vserver));
+    single.v = malloc((size_t)(nservers * cycles) * sizeof(double));
+    combined.v = malloc((size_t)((nservers / group + 1) * cycles) * sizeof(double));
+    if (servers == NULL || single.v == NULL || combined.v == NULL) {
+        fputs("Out of memory\n", stderr);
+        exit(1);
+    }
+
+    for (i = 0; i < nservers; i++) {
+        servers[i].skew = (2 * uniform(&w) - 1) * skew;
+        servers[i].drift = (2 * uniform(&w) - 1) * drift;
+        if (uniform(&w) < falsetickers)
+            servers[i].skew += (2 * uniform(&w) - 1) * 10;
+    }
+
+    /* Every group of web servers is polled by one htpdate instance, at
+       a random phase within the poll interval
+    */
+    for (g = 0; g < nservers; g += group) {
+        long long phase = (long long)(uniform(&w) * (double)interval * 1e9);
+
+        for (c = 0; c < cycles; c++) {
+            w.now = (EPOCH + c * interval) * HTP_NS + phase;
+            for (n = 0; n < group && g + n < nservers; n++) {
+                long long start = w.now;
+
+                w.server = &servers[g + n];
+                if (precision)
+                    timedelta[n] = htp_bisect(&b, precision, NULL,
+                        tracking ? &w.server->track : NULL, &simops, &w);
+                else
+                    timedelta[n] = htp_bisect(&b, HTP_MAX_PRECISION, &w.server->rtt,
+                        tracking ? &w.server->track : NULL, &simops, &w);
+                single.v[single.n++] = timedelta[n] - trueoffset(w.server, start);
+            }
+
+            good = htp_select(timedelta, n, &mean, &sum);
+            if (good) combined.v[combined.n++] = sum / good;
+        }
+    }
+
+    printf("servers %ld, %ld per htpdate, %ld poll cycles, precision ",
+        nservers, (long)group, cycles);
+    if (precision) printf("%d\n", precision); else puts("auto");
+    printf("requests per server per poll: %.2f\n\n", (double)w.requests / (double)single.n);
+    printf("error (ms)              mean    stddev       p50       p90       p99       max\n");
+    report("per web server", &single);
+    report("per htpdate", &combined);
+
+    /* The results are sorted by their absolute error now */
+    if (maxerror > 0 && fabs(single.v[single.n * 99 / 100]) > maxerror) {
+        printf("\np99 error per web server over %.3f ms\n", maxerror * 1e3);
+        exit(1);
+    }
+
+    free(servers);
+    free(single.v);
+    free(combined.v);
+    exit(0);
+}
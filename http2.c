@@ -0,0 +1,439 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Minimal HTTP/2 client framing (RFC 9113) and HPACK (RFC 7541) decoder
+ *
+ * Only what is needed to send HEAD requests and read back the response
+ * headers. The dynamic HPACK table is disabled by announcing a header
+ * table size of 0, server push is disabled and DATA frames are skipped.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "http2.h"
+
+#define H2_HEADERS          0x1
+#define H2_RST_STREAM       0x3
+#define H2_SETTINGS         0x4
+#define H2_PING             0x6
+#define H2_GOAWAY           0x7
+#define H2_CONTINUATION     0x9
+
+#define H2_END_STREAM       0x1
+#define H2_ACK              0x1
+#define H2_END_HEADERS      0x4
+#define H2_PADDED           0x8
+#define H2_PRIORITY         0x20
+
+#define HPACK_STATIC        61
+#define HPACK_MAXNAME       128
+
+static const char *hpack_static[HPACK_STATIC][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""},
+    {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""},
+    {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+    {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""}
+};
+
+/* Canonical Huffman code of RFC 7541 Appendix B: number of codes per
+   bit length and the symbols ordered by code
+*/
+static const unsigned char huff_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13,
+    26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const unsigned short huff_symbol[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52,
+    53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110,
+    112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78,
+    79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120,
+    121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35,
+    62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92, 195, 208, 128,
+    130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177, 179,
+    209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156,
+    160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196,
+    198, 228, 232, 233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182, 183, 188,
+    191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171, 206, 215, 225, 236,
+    237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213, 218,
+    219, 238, 240, 242, 243, 255, 203, 204, 211, 212, 214, 221, 222, 223,
+    241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5, 6, 7,
+    8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29,
+    30, 31, 127, 220, 249, 10, 13, 22, 256
+};
+
+
+static void frameheader(unsigned char *p, size_t length, int type, int flags, uint32_t stream) {
+    p[0] = (unsigned char)(length >> 16);
+    p[1] = (unsigned char)(length >> 8);
+    p[2] = (unsigned char)length;
+    p[3] = (unsigned char)type;
+    p[4] = (unsigned char)flags;
+    p[5] = (unsigned char)(stream >> 24) & 0x7f;
+    p[6] = (unsigned char)(stream >> 16);
+    p[7] = (unsigned char)(stream >> 8);
+    p[8] = (unsigned char)stream;
+}
+
+
+/* HPACK integer with an N-bit prefix, RFC 7541 5.1 */
+static unsigned char *putint(unsigned char *p, unsigned char *end, unsigned char flags, int prefix, size_t value) {
+    size_t max = (1u << prefix) - 1;
+
+    if (p == NULL || p >= end) return NULL;
+    if (value < max) {
+        *p++ = flags | (unsigned char)value;
+        return p;
+    }
+    *p++ = flags | (unsigned char)max;
+    value -= max;
+    while (value >= 128) {
+        if (p >= end) return NULL;
+        *p++ = (unsigned char)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (p >= end) return NULL;
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+
+/* Plain (not Huffman coded) string literal */
+static unsigned char *putstr(unsigned char *p, unsigned char *end, const char *s) {
+    size_t len = strlen(s);
+
+    p = putint(p, end, 0x00, 7, len);
+    if (p == NULL || (size_t)(end - p) < len) return NULL;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+
+/* Literal header field without indexing, indexed name, RFC 7541 6.2.2 */
+static unsigned char *putfield(unsigned char *p, unsigned char *end, int index, const char *value) {
+    return putstr(putint(p, end, 0x00, 4, (size_t)index), end, value);
+}
+
+
+static int getint(const unsigned char **p, const unsigned char *end, int prefix, size_t *value) {
+    size_t max = (1u << prefix) - 1, v;
+    int    shift = 0;
+    unsigned char b;
+
+    if (*p >= end) return -1;
+    v = *(*p)++ & max;
+    if (v == max) {
+        do {
+            if (*p >= end || shift > 21) return -1;
+            b = *(*p)++;
+            v += (size_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+    *value = v;
+    return 0;
+}
+
+
+static int append(char *out, size_t size, size_t *pos, const char *s, size_t len) {
+    if (*pos + len >= size) return -1;
+    memcpy(out + *pos, s, len);
+    *pos += len;
+    return 0;
+}
+
+
+static int huffman(const unsigned char *p, size_t len, char *out, size_t size, size_t *pos) {
+    int    code = 0, first = 0, index = 0, bits = 0, count, bit;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            code = code << 1 | ((p[i] >> bit) & 1);
+            count = huff_count[++bits];
+            if (code - first < count) {
+                unsigned short symbol = huff_symbol[index + code - first];
+                char c = (char)symbol;
+
+                if (symbol == 256 || append(out, size, pos, &c, 1)) return -1;
+                code = first = index = bits = 0;
+            } else {
+                index += count;
+                first = (first + count) << 1;
+                if (bits == 30) return -1;
+            }
+        }
+    }
+
+    /* Padding is the most significant bits of EOS, all ones */
+    if (bits > 7 || code != (1 << bits) - 1) return -1;
+    return 0;
+}
+
+
+/* String literal, RFC 7541 5.2 */
+static int getstr(const unsigned char **p, const unsigned char *end, char *out, size_t size, size_t *pos) {
+    int    coded;
+    size_t len;
+
+    if (*p >= end) return -1;
+    coded = **p & 0x80;
+    if (getint(p, end, 7, &len) || len > (size_t)(end - *p)) return -1;
+    if (coded) {
+        if (huffman(*p, len, out, size, pos)) return -1;
+    } else if (append(out, size, pos, (const char *)*p, len)) {
+        return -1;
+    }
+    *p += len;
+    return 0;
+}
+
+
+/* Decode a header block into HTTP/1 style "name: value" lines, so the
+   response can be handled like any other. The status line is rewritten
+   as "HTTP/2 <status>", other pseudo headers are dropped.
+*/
+static int hpack_decode(const unsigned char *p, size_t len, char *out, size_t size) {
+    const unsigned char *end = p + len;
+    size_t      pos = 0, index, start, namelen;
+    int         indexed, pseudo;
+    char        literal[HPACK_MAXNAME];
+    const char  *name;
+
+    while (p < end) {
+        indexed = *p & 0x80;
+        if (indexed) {                  /* Indexed header field */
+            if (getint(&p, end, 7, &index) || index == 0) return -1;
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update, only 0 is allowed as announced */
+            if (getint(&p, end, 5, &index) || index) return -1;
+            continue;
+        } else if (getint(&p, end, (*p & 0x40) ? 6 : 4, &index)) {
+            return -1;
+        }
+
+        /* No dynamic table, so only static entries can be referenced */
+        if (index > HPACK_STATIC) return -1;
+        if (index) {
+            name = hpack_static[index - 1][0];
+        } else {
+            namelen = 0;
+            if (getstr(&p, end, literal, sizeof(literal), &namelen)) return -1;
+            literal[namelen] = '\0';
+            name = literal;
+        }
+
+        start = pos;
+        pseudo = name[0] == ':';
+        if (strcmp(name, ":status") == 0) {
+            pseudo = 0;
+            if (append(out, size, &pos, "HTTP/2 ", 7)) return -1;
+        } else if (!pseudo) {
+            if (append(out, size, &pos, name, strlen(name)) ||
+                append(out, size, &pos, ": ", 2)) return -1;
+        }
+
+        if (indexed) {
+            const char *value = hpack_static[index - 1][1];
+            if (append(out, size, &pos, value, strlen(value))) return -1;
+        } else if (getstr(&p, end, out, size, &pos)) {
+            return -1;
+        }
+
+        if (pseudo)
+            pos = start;
+        else if (append(out, size, &pos, "\r\n", 2))
+            return -1;
+    }
+
+    if (append(out, size, &pos, "\r\n", 2)) return -1;
+    out[pos] = '\0';
+    return 0;
+}
+
+
+void h2_init(struct h2 *h) {
+    memset(h, 0, sizeof(struct h2));
+}
+
+
+/* Connection preface followed by our SETTINGS: no dynamic header table
+   (SETTINGS_HEADER_TABLE_SIZE 0) and no server push (SETTINGS_ENABLE_PUSH 0)
+*/
+size_t h2_preface(unsigned char *buf) {
+    static const unsigned char settings[12] = {
+        0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x02, 0x00, 0x00, 0x00, 0x00
+    };
+
+    memcpy(buf, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24);
+    frameheader(buf + 24, sizeof(settings), H2_SETTINGS, 0, 0);
+    memcpy(buf + 24 + H2_FRAMEHEADER, settings, sizeof(settings));
+    return H2_PREFACESIZE;
+}
+
+
+/* HEADERS frame with a complete HEAD request on the given stream,
+   returns the frame length or 0 if it doesn't fit
+*/
+size_t h2_request(unsigned char *buf, size_t size, uint32_t stream,
+    const char *authority, const char *path, const char *agent,
+    const char *auth) {
+
+    unsigned char *end = buf + size;
+    unsigned char *p = buf + H2_FRAMEHEADER;
+
+    if (size <= H2_FRAMEHEADER) return 0;
+
+    p = putfield(p, end, 2, "HEAD");            /* :method */
+    if (p != NULL && p < end) *p++ = 0x87;      /* :scheme https */
+    else p = NULL;
+    p = putfield(p, end, 1, authority);         /* :authority */
+    p = putfield(p, end, 4, path);              /* :path */
+    p = putfield(p, end, 58, agent);            /* user-agent */
+    p = putfield(p, end, 24, "no-cache");       /* cache-control */
+    p = putint(p, end, 0x00, 4, 0);             /* pragma, literal name */
+    p = putstr(p, end, "pragma");
+    p = putstr(p, end, "no-cache");
+    if (auth != NULL)
+        p = putfield(p, end, 23, auth);         /* authorization */
+    if (p == NULL) return 0;
+
+    frameheader(buf, (size_t)(p - buf) - H2_FRAMEHEADER, H2_HEADERS,
+        H2_END_STREAM | H2_END_HEADERS, stream);
+    return (size_t)(p - buf);
+}
+
+
+/* Reuse a prepared HEADERS frame for another stream */
+void h2_stream(unsigned char *frame, uint32_t stream) {
+    frame[5] = (unsigned char)(stream >> 24) & 0x7f;
+    frame[6] = (unsigned char)(stream >> 16);
+    frame[7] = (unsigned char)(stream >> 8);
+    frame[8] = (unsigned char)stream;
+}
+
+
+static int ack(struct h2 *h, int type, const unsigned char *payload, size_t len) {
+    if (h->outlen + H2_FRAMEHEADER + len > H2_OUTSIZE) return -1;
+    frameheader(h->out + h->outlen, len, type, H2_ACK, 0);
+    if (len) memcpy(h->out + h->outlen + H2_FRAMEHEADER, payload, len);
+    h->outlen += H2_FRAMEHEADER + len;
+    return 0;
+}
+
+
+/* Process the complete frames in the input. Returns the number of bytes
+   consumed, or -1 on a protocol or stream error. Once the response
+   headers of the outstanding stream are decoded into "headers", h->done
+   is set. Frames to be sent back to the server are queued in h->out.
+*/
+long h2_input(struct h2 *h, const unsigned char *in, size_t len,
+    char *headers, size_t size) {
+
+    size_t consumed = 0, length, n;
+    int    type, flags;
+    uint32_t stream;
+
+    while (consumed < len) {
+        const unsigned char *p = in + consumed;
+
+        /* Payload of a frame we are not interested in */
+        if (h->skip) {
+            n = len - consumed < h->skip ? len - consumed : h->skip;
+            h->skip -= n;
+            consumed += n;
+            continue;
+        }
+
+        if (len - consumed < H2_FRAMEHEADER) break;
+        length = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+        type   = p[3];
+        flags  = p[4];
+        stream = ((uint32_t)p[5] << 24 | (uint32_t)p[6] << 16 |
+                  (uint32_t)p[7] << 8 | p[8]) & 0x7fffffff;
+
+        if (h->continuation && type != H2_CONTINUATION) return -1;
+
+        /* DATA, PRIORITY, WINDOW_UPDATE and unknown frames are skipped */
+        if (type != H2_HEADERS && type != H2_CONTINUATION &&
+            type != H2_SETTINGS && type != H2_PING &&
+            type != H2_RST_STREAM && type != H2_GOAWAY) {
+            h->skip = length;
+            consumed += H2_FRAMEHEADER;
+            continue;
+        }
+
+        /* Wait for the complete frame */
+        if (len - consumed < H2_FRAMEHEADER + length) break;
+        p += H2_FRAMEHEADER;
+        consumed += H2_FRAMEHEADER + length;
+
+        switch (type) {
+            case H2_HEADERS:
+                if (flags & H2_PADDED) {
+                    if (length < 1 || p[0] >= length) return -1;
+                    length -= 1 + p[0];
+                    p++;
+                }
+                if (flags & H2_PRIORITY) {
+                    if (length < 5) return -1;
+                    length -= 5;
+                    p += 5;
+                }
+                h->blocklen = 0;
+                /* fall through */
+            case H2_CONTINUATION:
+                if (h->blocklen + length > H2_BLOCKSIZE) return -1;
+                memcpy(h->block + h->blocklen, p, length);
+                h->blocklen += length;
+                h->continuation = !(flags & H2_END_HEADERS);
+                if (!h->continuation && stream == h->stream) {
+                    if (hpack_decode(h->block, h->blocklen, headers, size))
+                        return -1;
+                    h->done = 1;
+                }
+                break;
+            case H2_SETTINGS:
+                if (!(flags & H2_ACK) && ack(h, H2_SETTINGS, NULL, 0))
+                    return -1;
+                break;
+            case H2_PING:
+                if (!(flags & H2_ACK) && (length != 8 || ack(h, H2_PING, p, 8)))
+                    return -1;
+                break;
+            case H2_RST_STREAM:
+                if (stream == h->stream && !h->done) return -1;
+                break;
+            case H2_GOAWAY:
+                /* Requests beyond the last stream id won't be answered */
+                if (length < 8) return -1;
+                if (!h->done && (((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+                    (uint32_t)p[2] << 8 | p[3]) & 0x7fffffff) < h->stream)
+                    return -1;
+                break;
+        }
+    }
+
+    return (long)consumed;
+}
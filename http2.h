@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Minimal HTTP/2 client framing (RFC 9113) and HPACK (RFC 7541) decoder
+ */
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define H2_ALPN             "\x02h2\x08http/1.1"
+#define H2_PREFACESIZE      (24 + 9 + 12)
+#define H2_FRAMEHEADER      9
+#define H2_BLOCKSIZE        8192
+#define H2_OUTSIZE          256
+
+struct h2 {
+    uint32_t        stream;             /* stream of the outstanding request */
+    int             done;               /* response headers of stream decoded */
+    int             continuation;       /* header block continues */
+    size_t          skip;               /* payload bytes of ignored frame left */
+    size_t          blocklen;
+    unsigned char   block[H2_BLOCKSIZE];
+    size_t          outlen;
+    unsigned char   out[H2_OUTSIZE];    /* SETTINGS/PING acknowledgements */
+};
+
+void h2_init(struct h2 *h);
+size_t h2_preface(unsigned char *buf);
+size_t h2_request(unsigned char *buf, size_t size, uint32_t stream,
+    const char *authority, const char *path, const char *agent,
+    const char *auth);
+void h2_stream(unsigned char *frame, uint32_t stream);
+long h2_input(struct h2 *h, const unsigned char *in, size_t len,
+    char *headers, size_t size);
+
+#endif
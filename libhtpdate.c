@@ -0,0 +1,2156 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * libhtpdate, time offsets of web servers without blocking the caller
+ *
+ * Every source (web server) of a measurement runs through the states
+ *
+ *   PENDING [-> RESOLVE] -> CONNECT [-> PROXY] [-> TLS] -> WAIT <-> RECV -> DONE
+ *
+ * on a non-blocking socket. WAIT holds the request until the moment the
+ * bisection has chosen for it, RECV collects the response headers.
+ * htp_step() makes progress on all sources that are ready, it never
+ * waits for the network, and only sleeps (once) for the requests that
+ * are due within SPIN_NS so the bisection timing doesn't depend on the
+ * event loop of the caller. A request that missed its moment by more
+ * than a quarter of the bisection step (or tracking window) waits for
+ * the same moment of the next second instead; a little late, it goes
+ * out and the time it was actually sent is what the sample uses.
+ *
+ * The duration of every phase of a request (name resolution, connect,
+ * proxy tunnel, TLS handshake, send lateness, time to first byte, rest
+ * of the headers, parsing) goes into a log2 histogram and a USDT probe
+ * of the same name, see trace.h.
+ */
+
+/* Needed for strcasestr, strptime and timegm */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "arena.h"
+#include "base64.h"
+#include "bisect.h"
+#include "capture.h"
+#include "libhtpdate.h"
+#include "trace.h"
+
+#ifdef ENABLE_HTTPS
+#include <openssl/ssl.h>
+#include "http2.h"
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL             0
+#endif
+
+#define DEFAULT_HTTP_PORT        "80"
+#define DEFAULT_PROXY_PORT       "8080"
+#define DEFAULT_PRECISION        4                 /* 4 request per host */
+#define DEFAULT_TIMEOUT          10000             /* 10 seconds */
+#define HEADREQUESTSIZE          1024
+#define URLSIZE                  128
+#define HEADERNAMESIZE           64
+#define BUFFERSIZE               8192
+#define LOGSIZE                  512               /* keeps stack frames small */
+#define MAX_CAPTURE              32                /* requests per measurement */
+#define SPIN_NS                  2000000           /* sleep for requests due within 2 ms */
+#define LATE_NS                  500000            /* late requests are sent, at least 0.5 ms */
+#define MIN_BACKOFF              60                /* s, after 429 or 503 without Retry-After */
+#define MAX_BACKOFF              86400
+
+#define HIST_BUCKETS             36                /* log2 ns, up to 34 s */
+
+enum { ST_PENDING, ST_RESOLVE, ST_CONNECT, ST_PROXY, ST_TLS, ST_WAIT, ST_RECV, ST_DONE };
+
+enum { PH_RESOLVE, PH_CONNECT, PH_PROXY, PH_TLS, PH_SEND, PH_TTFB, PH_HEADERS, PH_PARSE, PH_COUNT };
+
+static const char *const phasename[PH_COUNT] = {
+    "resolve", "connect", "proxy", "tls", "send", "ttfb", "headers", "parse"
+};
+
+/* Duration of a phase: its probe and histogram */
+#define PHASE(ctx, src, name, ph, from, to) do { \
+        long long ns_ = nsdiff(to, from); \
+        HTP_PROBE(name, (src)->id, ns_); \
+        histogram(ctx, ph, ns_); \
+    } while (0)
+
+
+/* Name resolution by a thread, shared with the source that asked for it */
+struct lookup {
+    _Atomic int     refs;           /* the thread and the source */
+    int             fd;             /* to report on, for the thread */
+    int             rc;
+    char            *host, *port;
+    struct addrinfo hints, *res;
+};
+
+/* Lookup threads running, process wide */
+static _Atomic int lookups;
+
+
+/* A connection with its buffers, taken from the pool of the context
+   while a source is measured (or kept open via a proxy)
+*/
+struct conn {
+    int             fd;
+    struct addrinfo *res, *ai;      /* addresses left to try */
+    int             ownres;         /* res from getaddrinfo() */
+    struct lookup   *lookup;        /* name resolution under way */
+    struct timespec start;          /* of connect */
+    size_t          length;
+    char            buffer[BUFFERSIZE];
+    #ifdef ENABLE_HTTPS
+    SSL             *ssl;
+    int             use_h2;
+    int             readblocked;    /* SSL_read() waits for POLLOUT */
+    int             ktls;           /* 1 send, 2 receive offloaded */
+    uint32_t        stream;
+    struct h2       h2;
+    size_t          pending;
+    unsigned char   frames[BUFFERSIZE];
+    #endif
+    int             nrecords;
+    struct capture_record records[MAX_CAPTURE];
+    struct conn     *next;          /* free list */
+};
+
+
+/* A web server with its requests, prepared once when added so a
+   measurement doesn't need to format requests
+*/
+struct source {
+    int             id;             /* order of adding */
+    char            *url;           /* copy, split in place */
+    char            *scheme;
+    char            *host, *port, *path, *auth;
+    const char      *name;          /* in messages, host or address */
+    struct addrinfo pin;            /* the one address of an expanded host */
+    int             group;          /* first source of an expanded host, or -1 */
+    struct sockaddr_storage addr;
+    char            address[INET6_ADDRSTRLEN];
+    char            *hires;         /* high resolution timestamp header */
+    long            hiresscale;     /* its units per second */
+    char            hiresmatch[HEADERNAMESIZE];
+    char            headrequest[HEADREQUESTSIZE];
+    size_t          headlength;
+    char            connectrequest[HEADREQUESTSIZE];
+    size_t          connectlength;
+    #ifdef ENABLE_HTTPS
+    unsigned char   h2request[HEADREQUESTSIZE];
+    size_t          h2length;
+    #endif
+    struct htp_rtt  rtt;            /* for automatic precision */
+    long            netvar;         /* TCP round trip variation, ns */
+    struct htp_track track;         /* second boundary of the last measurements */
+    time_t          holdoff;        /* not before, after 429 or 503 */
+    long            backoff;        /* s, doubles while the web server is busy */
+    double          tokens;         /* requests left of the budget */
+    time_t          refilled;
+
+    /* Measurement */
+    struct conn     *conn;
+    int             state;
+    short           events;         /* poll events waited for */
+    short           epevents;       /* registered with epoll, -1 if not */
+    int             reused;         /* connection kept from last measurement */
+    struct bisect   b;
+    struct timespec at;             /* scheduled send time */
+    struct timespec sent;
+    struct timespec firstbyte;      /* of the response, 0 before */
+    struct timespec deadline;       /* of connect or response */
+    struct htp_result result;
+};
+
+
+struct htp_ctx {
+    struct htp_options opt;
+    char            *proxyurl;      /* copy, split in place */
+    char            *proxy, *proxyport, *proxyauth;
+    struct source   **sources;
+    int             nsources, size;
+    int             next;           /* first source not started */
+    int             running;        /* sources not done */
+    int             keep;           /* keep proxy connections */
+    struct source   **act;          /* sources being measured */
+    int             nact;
+    struct pollfd   *pfd;
+    struct conn     *free;
+    int             nconns;
+    int             epfd, tfd;
+    struct arena    arena;          /* per measurement memory, -A */
+    unsigned long   hist[PH_COUNT][HIST_BUCKETS];
+    unsigned long   tlsmark;        /* OpenSSL allocations at start */
+    #ifdef ENABLE_HTTPS
+    SSL_CTX         *tls;
+    #endif
+};
+
+
+#ifdef ENABLE_HTTPS
+/* Heap allocations by OpenSSL, process wide (all threads and contexts),
+   counted once htp_count_tls() installed the hooks
+*/
+static _Atomic unsigned long tlsallocs;
+
+
+static void *tlsmalloc(size_t num, const char *file, int line) {
+    tlsallocs++;
+    return malloc(num);
+}
+
+
+static void *tlsrealloc(void *p, size_t num, const char *file, int line) {
+    tlsallocs++;
+    return realloc(p, num);
+}
+
+
+static void tlsfree(void *p, const char *file, int line) {
+    free(p);
+}
+#endif
+
+
+static void htplog(const struct htp_ctx *ctx, int is_error, const char *format, ...) {
+    va_list args;
+    char buf[LOGSIZE];
+
+    if (ctx->opt.log == NULL && !is_error) return;
+
+    va_start(args, format);
+    (void) vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (ctx->opt.log)
+        ctx->opt.log(ctx->opt.logarg, is_error, buf);
+    else
+        fprintf(stderr, "%s\n", buf);
+}
+
+
+static long long nsdiff(const struct timespec *a, const struct timespec *b) {
+    return (long long)(a->tv_sec - b->tv_sec) * HTP_NS + a->tv_nsec - b->tv_nsec;
+}
+
+
+static void histogram(struct htp_ctx *ctx, int ph, long long ns) {
+    int b = 0;
+
+    while (ns > 0 && b < HIST_BUCKETS - 1) {
+        ns >>= 1;
+        b++;
+    }
+    ctx->hist[ph][b]++;
+}
+
+
+static void nsadd(struct timespec *ts, long long ns) {
+    ns += ts->tv_nsec;
+    ts->tv_sec += (time_t)(ns / HTP_NS);
+    ts->tv_nsec = (long)(ns % HTP_NS);
+    if (ts->tv_nsec < 0) {
+        ts->tv_nsec += HTP_NS;
+        ts->tv_sec--;
+    }
+}
+
+
+/* Split argument in hostname/IP-address and TCP port
+   Supports IPv6 literal addresses, RFC 2732.
+   Returns -1 for https without HTTPS support.
+*/
+static int splitURL(char **scheme, char **host, char **port, char **path, char **auth) {
+    char *rb, *rc, *lb, *lc, *ps, *basic_auth;
+
+    *path = "";
+    *scheme = NULL;
+
+    if ((ps = strcasestr(*host, "https://")) != NULL) {
+        #ifndef ENABLE_HTTPS
+        return -1;
+        #endif
+        *scheme = "https://";
+        *port = "443";
+        *host = ps + 8;
+    }
+
+    if ((ps = strcasestr(*host, "http://")) != NULL) {
+        *host = ps + 7;
+    }
+
+    basic_auth = strchr(*host, '@');
+    /* Extract user:pass combo */
+    if (basic_auth != NULL) {
+        basic_auth[0] = '\0';
+        *auth = *host;
+        *host = basic_auth + 1;
+    }
+
+
+    lb = strchr(*host, '[');
+    rb = strrchr(*host, ']');
+    lc = strchr(*host, ':');
+    rc = strrchr(*host, ':');
+    ps = strchr(*host, '/');
+
+    /* Extract URL path */
+    if (ps != NULL) {
+        ps[0] = '\0';
+        *path = ps + 1;
+    }
+
+    /* A (literal) IPv6 address with portnumber */
+    if (rb < rc && lb != NULL && rb != NULL) {
+        rb[0] = '\0';
+        *port = rc + 1;
+        *host = lb + 1;
+        return 0;
+    }
+
+    /* A (literal) IPv6 address without portnumber */
+    if (rb != NULL && lb != NULL) {
+        rb[0] = '\0';
+        *host = lb + 1;
+        return 0;
+    }
+
+    /* A IPv4 address or hostname with portnumber */
+    if (rc != NULL && lc == rc) {
+        rc[0] = '\0';
+        *port = rc + 1;
+    }
+    return 0;
+}
+
+
+static long long getremotetime(const struct htp_ctx *ctx, char remote_time[25]) {
+    struct tm       tm;
+
+    memset(&tm, 0, sizeof(struct tm));
+    if (strptime(remote_time, "%d %b %Y %T", &tm) == NULL) {
+        htplog(ctx, 1, "unknown time format");
+        return 0;
+    }
+    return timegm(&tm);
+}
+
+
+/* Prepare the requests for a web server, host:port is split in place */
+static int initsource(struct htp_ctx *ctx, struct source *src) {
+    char    url[URLSIZE] = {'\0'};
+    char    auth_value[HEADREQUESTSIZE] = {'\0'};
+    char    auth_header[HEADREQUESTSIZE] = {'\0'};
+    char    proxy_header[HEADREQUESTSIZE] = {'\0'};
+    char    *encoded, *format;
+
+    src->host = src->url;
+    src->port = DEFAULT_HTTP_PORT;
+    src->auth = NULL;
+
+    /* The URL fragment names a header with a high resolution timestamp,
+       e.g. #X-Timestamp=ms; it is not part of the request
+    */
+    src->hires = strrchr(src->url, '#');
+    if (src->hires != NULL) {
+        *src->hires++ = '\0';
+        src->hiresscale = 1;
+        if ((format = strchr(src->hires, '=')) != NULL) {
+            *format++ = '\0';
+            if (strcmp(format, "ms") == 0) src->hiresscale = 1000;
+            else if (strcmp(format, "us") == 0) src->hiresscale = 1000000;
+            else if (strcmp(format, "ns") == 0) src->hiresscale = 1000000000;
+            else if (strcmp(format, "s") != 0) {
+                htplog(ctx, 1, "Unknown timestamp format %s", format);
+                return -1;
+            }
+        }
+        if (*src->hires == '\0' || strlen(src->hires) > HEADERNAMESIZE - 3) {
+            htplog(ctx, 1, "Invalid timestamp header %s", src->hires);
+            return -1;
+        }
+        snprintf(src->hiresmatch, HEADERNAMESIZE, "\n%s:", src->hires);
+    }
+
+    if (splitURL(&src->scheme, &src->host, &src->port, &src->path, &src->auth)) {
+        htplog(ctx, 1, "HTTPS not supported, %s", src->host);
+        return -1;
+    }
+
+    /* Build the basic auth headers */
+    if (src->auth != NULL) {
+        encoded = (char *)base64_encode((unsigned char *)src->auth, strlen(src->auth), NULL);
+        if (encoded == NULL) {
+            htplog(ctx, 1, "Error encoding base64 for auth to %s", src->host);
+            return -1;
+        }
+        snprintf(auth_value, HEADREQUESTSIZE, "Basic %s", encoded);
+        snprintf(auth_header, HEADREQUESTSIZE, "Authorization: %s\r\n", auth_value);
+        free(encoded);
+    }
+
+    if (ctx->proxy != NULL && ctx->proxyauth != NULL) {
+        encoded = (char *)base64_encode((unsigned char *)ctx->proxyauth, strlen(ctx->proxyauth), NULL);
+        if (encoded == NULL) {
+            htplog(ctx, 1, "Error encoding base64 for auth to proxy %s", ctx->proxy);
+            return -1;
+        }
+        snprintf(proxy_header, HEADREQUESTSIZE, "Proxy-Authorization: Basic %s\r\n", encoded);
+        free(encoded);
+    }
+
+    /* Plain HTTP requests to a proxy server contain the absolute URL,
+       HTTPS requests go through a tunnel (CONNECT)
+    */
+    if (ctx->proxy != NULL && src->scheme == NULL)
+        snprintf(url, URLSIZE, "http://%s:%s", src->host, src->port);
+
+    /* Build a combined HTTP/1.0 and 1.1 HEAD request
+       Pragma: no-cache, "forces" an HTTP/1.0 and 1.1 compliant
+       web server to return a fresh timestamp
+       Connection: keep-alive, for multiple requests
+    */
+    src->headlength = (size_t)snprintf(src->headrequest, HEADREQUESTSIZE,
+        "HEAD %s/%s HTTP/1.%d\r\n"
+        "Host: %s\r\n"
+        "User-Agent: htpdate/"HTP_VERSION"\r\n"
+        "Pragma: no-cache\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: keep-alive\r\n"
+        "%s%s"
+        "\r\n",
+        url, src->path, ctx->opt.httpversion, src->host, auth_header,
+        src->scheme ? "" : proxy_header);
+
+    src->connectlength = (size_t)snprintf(src->connectrequest, HEADREQUESTSIZE,
+        "CONNECT %s:%s HTTP/1.%d\r\n"
+        "Host: %s:%s\r\n"
+        "%s"
+        "\r\n",
+        src->host, src->port, ctx->opt.httpversion, src->host, src->port, proxy_header);
+
+    if (src->headlength >= HEADREQUESTSIZE || src->connectlength >= HEADREQUESTSIZE) {
+        htplog(ctx, 1, "URL too long: %s", src->host);
+        return -1;
+    }
+
+    #ifdef ENABLE_HTTPS
+    /* HTTP/2 HEADERS frame, only the stream id changes per request */
+    snprintf(url, URLSIZE, "/%s", src->path);
+    src->h2length = h2_request(src->h2request, HEADREQUESTSIZE, 1, src->host,
+        url, "htpdate/"HTP_VERSION, src->auth ? auth_value : NULL);
+    #endif
+
+    return 0;
+}
+
+
+/* Time offset from a high resolution timestamp header, taken by the
+   server "back" ns before the response was received.
+   Returns -1 when the response doesn't contain the timestamp.
+*/
+static int gethires(
+    const struct source *src, const char *buffer,
+    const struct timespec *received, long long back, double *offset) {
+
+    char        *p = strcasestr(buffer, src->hiresmatch);
+    long long   value, sec;
+    long        nsec = 0, scale = 100000000;
+
+    if (p == NULL) return -1;
+
+    /* Skip whitespace and prefixes like "t=" (X-Request-Start) */
+    p += strlen(src->hiresmatch);
+    while (*p != '\0' && *p != '\r' && !isdigit((unsigned char)*p)) p++;
+    if (!isdigit((unsigned char)*p)) return -1;
+
+    value = strtoll(p, &p, 10);
+    if (src->hiresscale == 1) {
+        sec = value;
+        if (*p == '.') {
+            while (isdigit((unsigned char)*++p)) {
+                nsec += (*p - '0') * scale;
+                scale /= 10;
+            }
+        }
+    } else {
+        sec = value / src->hiresscale;
+        nsec = (value % src->hiresscale) * (1000000000 / src->hiresscale);
+    }
+
+    *offset = (double)(sec - received->tv_sec) + (double)(nsec - received->tv_nsec + back) / 1e9;
+    return 0;
+}
+
+
+/* Value of a response header, or NULL */
+static const char *getheader(const char *buffer, const char *name) {
+    const char  *p = buffer;
+    size_t      n = strlen(name);
+
+    while (p != NULL) {
+        if (strncasecmp(p, name, n) == 0 && p[n] == ':') {
+            for (p += n + 1; *p == ' ' || *p == '\t'; p++);
+            return p;
+        }
+        if ((p = strchr(p, '\n')) != NULL) p++;
+    }
+    return NULL;
+}
+
+
+/* A response from a cache carries the Date of the original response,
+   Age tells how old it is (RFC 9111). Other cache headers only show
+   the response didn't come from the web server itself, e.g. X-Cache: HIT
+*/
+static long cacheage(const struct htp_ctx *ctx, const struct source *src, const char *buffer) {
+    static const char *const hit[] = {"X-Cache", "X-Cache-Status", "CF-Cache-Status", "X-Proxy-Cache"};
+    const char  *p;
+    size_t      i;
+
+    if ((p = getheader(buffer, "Age")) != NULL && atol(p) > 0) return atol(p);
+
+    for (i = 0; ctx->opt.debug && i < sizeof(hit) / sizeof(hit[0]); i++) {
+        if ((p = getheader(buffer, hit[i])) != NULL && strncasecmp(p, "HIT", 3) == 0)
+            htplog(ctx, 0, "%s cache hit (%s)", src->name, hit[i]);
+    }
+    return 0;
+}
+
+
+/* Status code of the response, "HTTP/2 <status>" for HTTP/2 */
+static int httpstatus(const char *buffer) {
+    const char  *p;
+
+    if (strncmp(buffer, "HTTP/", 5) != 0 || (p = strchr(buffer, ' ')) == NULL) return 0;
+    return atoi(p + 1);
+}
+
+
+/* Network round trip of the connection according to the TCP stack,
+   which unlike the round trip of a request doesn't include the time
+   the web server takes to answer. Through a proxy the TCP stack only
+   knows the proxy hop. Returns 0 when unknown.
+*/
+static long netrtt(const struct htp_ctx *ctx, struct source *src) {
+    #ifdef __linux__
+    struct tcp_info ti;
+    socklen_t       len = sizeof(ti);
+
+    if (ctx->proxy == NULL && getsockopt(src->conn->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt) {
+        src->netvar = (long)ti.tcpi_rttvar * 1000;
+        return (long)ti.tcpi_rtt * 1000;
+    }
+    #endif
+    return 0;
+}
+
+
+/* Copy the resolved addresses into the arena, which takes them off the
+   heap right away
+*/
+static struct addrinfo *arenacopy(struct arena *a, const struct addrinfo *res) {
+    struct addrinfo *head = NULL, **tail = &head, *ai;
+    struct sockaddr *addr;
+
+    for (; res != NULL; res = res->ai_next) {
+        if ((ai = arena_alloc(a, sizeof(struct addrinfo))) == NULL ||
+            (addr = arena_alloc(a, res->ai_addrlen)) == NULL)
+            return NULL;
+        *ai = *res;
+        memcpy(addr, res->ai_addr, res->ai_addrlen);
+        ai->ai_addr = addr;
+        ai->ai_canonname = NULL;
+        ai->ai_next = NULL;
+        *tail = ai;
+        tail = &ai->ai_next;
+    }
+    return head;
+}
+
+
+static void freeres(struct conn *conn) {
+    if (conn->res != NULL && conn->ownres) freeaddrinfo(conn->res);
+    conn->res = NULL;
+}
+
+
+static void releaselookup(struct lookup *l) {
+    if (--l->refs) return;
+    if (l->res) freeaddrinfo(l->res);
+    free(l);
+}
+
+
+/* Done with a lookup, finished or not; its socket is closed by the caller */
+static void endlookup(struct conn *conn) {
+    releaselookup(conn->lookup);
+    conn->lookup = NULL;
+}
+
+
+static void setphase(struct source *src, int state, short events) {
+    src->state = state;
+    src->events = events;
+}
+
+
+static void closeconn(struct htp_ctx *ctx, struct source *src) {
+    struct conn *conn = src->conn;
+
+    if (conn == NULL) return;
+
+    #ifdef __linux__
+    if (src->epevents >= 0 && conn->fd >= 0)
+        epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    #endif
+    src->epevents = -1;
+
+    #ifdef ENABLE_HTTPS
+    if (conn->ssl != NULL) {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    #endif
+    if (conn->lookup != NULL) endlookup(conn);
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    freeres(conn);
+}
+
+
+/* Close the connection and return it to the pool */
+static void releaseconn(struct htp_ctx *ctx, struct source *src) {
+    if (src->conn == NULL) return;
+
+    closeconn(ctx, src);
+    src->conn->next = ctx->free;
+    ctx->free = src->conn;
+    src->conn = NULL;
+}
+
+
+static void finish(struct htp_ctx *ctx, struct source *src, int status, double offset) {
+    struct conn *conn = src->conn;
+    struct timespec now;
+    int         i;
+
+    src->result.status = status;
+    src->result.offset = status == HTP_OK ? offset : HTP_ERROR;
+    if (status == HTP_OK) src->backoff = 0;
+    src->result.precision = src->b.polls;
+    src->result.rtt = (double)src->b.rtt / 1e9;
+    if (src->b.net > 0 && src->b.net < src->b.rtt) {
+        src->result.network = (double)src->b.net / 1e9;
+        src->result.server = (double)(src->b.rtt - src->b.net) / 1e9;
+    }
+    #ifdef ENABLE_HTTPS
+    src->result.http2 = conn && conn->use_h2;
+    src->result.ktls = conn ? conn->ktls : 0;
+    #endif
+
+    /* All requests of the measurement share its outcome */
+    if (ctx->opt.capture && conn && conn->nrecords) {
+        for (i = 0; i < conn->nrecords; i++)
+            conn->records[i].offset = status == HTP_OK ? (int64_t)(offset * 1e9) : CAPTURE_NONE;
+        if (capture_write(ctx->opt.capture, conn->records, conn->nrecords))
+            htplog(ctx, 1, "Capture write failed");
+    }
+
+    if (ctx->opt.debug && src->result.network > 0)
+        htplog(ctx, 0, "%s network %.3f ms (rttvar %.3f ms), server %.3f ms", src->name,
+            src->result.network * 1e3, (double)src->netvar / 1e6, src->result.server * 1e3);
+
+    if (status == HTP_OK && ctx->opt.tracking && !src->result.hires) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        track_update(&src->track, &now, offset, bisect_latency(&src->b), src->b.rtt);
+        if (ctx->opt.debug && src->b.tracked != HTP_ERROR)
+            htplog(ctx, 0, "%s tracked, predicted %.3f s", src->name, src->b.predicted);
+    }
+
+    if (ctx->opt.debug && src->b.polls) {
+        htplog(ctx, 0, "when: %ld, nap: %ld", src->b.when, src->b.nap);
+        if (ctx->opt.precision == 0)
+            htplog(ctx, 0, "%s precision %d, %d probes saved, rtt %ld ms, jitter %.3f ms",
+                src->name, src->b.polls, HTP_MAX_PRECISION - src->b.polls,
+                src->rtt.srtt / (long)1e6, (double)src->rtt.rttvar / 1e6);
+    }
+
+    /* Keep the (tunneled) connection to the proxy for the next measurement */
+    if (ctx->keep && status == HTP_OK && conn && conn->fd >= 0) {
+        #ifdef __linux__
+        if (src->epevents >= 0) epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        #endif
+        src->epevents = -1;
+    } else {
+        releaseconn(ctx, src);
+    }
+
+    setphase(src, ST_DONE, 0);
+    ctx->running--;
+    if (ctx->opt.done) ctx->opt.done(ctx->opt.donearg, src->id, &src->result);
+}
+
+
+static void fail(struct htp_ctx *ctx, struct source *src, int status, const char *format, ...) {
+    va_list args;
+    char buf[LOGSIZE];
+
+    va_start(args, format);
+    (void) vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    htplog(ctx, 1, "%s", buf);
+    finish(ctx, src, status, HTP_ERROR);
+}
+
+
+static void sethints(const struct htp_ctx *ctx, struct addrinfo *hints) {
+    memset(hints, 0, sizeof(struct addrinfo));
+    switch(ctx->opt.ipversion) {
+        case 4:                     /* IPv4 only */
+            hints->ai_family = AF_INET;
+            break;
+        case 6:                     /* IPv6 only */
+            hints->ai_family = AF_INET6;
+            break;
+        default:                    /* Support IPv6 and IPv4 name resolution */
+            hints->ai_family = PF_UNSPEC;
+    }
+    hints->ai_socktype = SOCK_STREAM;
+    hints->ai_flags = AI_CANONNAME;
+}
+
+
+/* Resolve a name in a thread of its own, as getaddrinfo() blocks. The
+   thread reports on a socket the source polls instead of its connection,
+   and whichever side lets go of the lookup last frees it, so a source
+   can give up on a lookup that hangs.
+*/
+static void *runlookup(void *arg) {
+    struct lookup   *l = arg;
+
+    l->rc = getaddrinfo(l->host, l->port, &l->hints, &l->res);
+    send(l->fd, "", 1, MSG_NOSIGNAL);
+    close(l->fd);
+    lookups--;
+    releaselookup(l);
+    return NULL;
+}
+
+
+/* Start resolving the web server, or the proxy, for a source.
+   Returns -1 when no lookup could be started.
+*/
+static int startlookup(struct htp_ctx *ctx, struct source *src) {
+    struct conn     *conn = src->conn;
+    struct lookup   *l;
+    pthread_attr_t  attr;
+    pthread_t       thread;
+    const char      *host = ctx->proxy ? ctx->proxy : src->host;
+    const char      *port = ctx->proxy ? ctx->proxyport : src->port;
+    int             sv[2], rc;
+
+    /* Lookups that hang past their timeout still hold a thread, no more
+       of them than connections
+    */
+    if (lookups >= ctx->nconns) return -1;
+
+    if ((l = calloc(1, sizeof(struct lookup) + strlen(host) + strlen(port) + 2)) == NULL) return -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+        free(l);
+        return -1;
+    }
+    l->host = (char *)(l + 1);
+    l->port = l->host + strlen(host) + 1;
+    strcpy(l->host, host);
+    strcpy(l->port, port);
+    sethints(ctx, &l->hints);
+    l->fd = sv[1];
+    l->refs = 2;
+
+    lookups++;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(&thread, &attr, runlookup, l);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        lookups--;
+        close(sv[0]);
+        close(sv[1]);
+        free(l);
+        return -1;
+    }
+
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    conn->fd = sv[0];
+    conn->lookup = l;
+    clock_gettime(CLOCK_REALTIME, &conn->start);
+    src->deadline = conn->start;
+    nsadd(&src->deadline, (long long)ctx->opt.timeout * 1000000);
+    setphase(src, ST_RESOLVE, POLLIN);
+    return 0;
+}
+
+
+static void startconnect(struct htp_ctx *ctx, struct source *src);
+
+
+/* The lookup thread is done, connect to the addresses it found */
+/* Tie a source to one address of its host */
+static void pin(struct source *src, const struct addrinfo *ai) {
+    memcpy(&src->addr, ai->ai_addr, ai->ai_addrlen);
+    src->pin = *ai;
+    src->pin.ai_addr = (struct sockaddr *)&src->addr;
+    src->pin.ai_canonname = NULL;
+    src->pin.ai_next = NULL;
+    getnameinfo(ai->ai_addr, ai->ai_addrlen, src->address, sizeof(src->address), NULL, 0, NI_NUMERICHOST);
+    src->name = src->result.address = src->address;
+}
+
+
+static int pinned(const struct source *src, const struct addrinfo *ai) {
+    return src->pin.ai_addrlen == ai->ai_addrlen && memcmp(&src->addr, ai->ai_addr, ai->ai_addrlen) == 0;
+}
+
+
+/* Start the bisection of a source, tracking from its last measurements */
+static void startbisect(struct htp_ctx *ctx, struct source *src, const struct timespec *now) {
+    if (ctx->opt.precision == 0)
+        bisect_init(&src->b, HTP_MAX_PRECISION, &src->rtt);
+    else
+        bisect_init(&src->b, ctx->opt.precision, NULL);
+    if (ctx->opt.tracking && !src->hires) track_start(&src->track, &src->b, now);
+}
+
+
+/* An expanded host keeps its address while the name still resolves to
+   it, otherwise it takes one that no other source of the host has, and
+   starts over as a new web server. Returns -1 if none is left.
+*/
+static int repin(struct htp_ctx *ctx, struct source *src, const struct addrinfo *res, const struct timespec *now) {
+    const struct addrinfo   *ai, *spare = NULL;
+    int                     i;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if (pinned(src, ai)) return 0;
+        for (i = src->group; i < ctx->nsources && ctx->sources[i]->group == src->group; i++) {
+            if (pinned(ctx->sources[i], ai)) break;
+        }
+        if (spare == NULL && (i == ctx->nsources || ctx->sources[i]->group != src->group)) spare = ai;
+    }
+    if (spare == NULL) return -1;
+
+    pin(src, spare);
+    if (ctx->opt.debug) htplog(ctx, 0, "%s address %s", src->host, src->address);
+    memset(&src->rtt, 0, sizeof(src->rtt));
+    memset(&src->track, 0, sizeof(src->track));
+    src->netvar = 0;
+    startbisect(ctx, src, now);
+    return 0;
+}
+
+
+static void resolved(struct htp_ctx *ctx, struct source *src) {
+    struct conn     *conn = src->conn;
+    struct addrinfo *res = conn->lookup->res;
+    struct timespec now;
+    char            c;
+    int             rc = conn->lookup->rc;
+
+    if (recv(conn->fd, &c, 1, 0) != 1) return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    PHASE(ctx, src, resolve, PH_RESOLVE, &conn->start, &now);
+
+    /* The socket of the lookup makes way for the connection */
+    #ifdef __linux__
+    if (src->epevents >= 0) epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    #endif
+    src->epevents = -1;
+    conn->lookup->res = NULL;
+    endlookup(conn);
+    close(conn->fd);
+    conn->fd = -1;
+
+    /* Was the hostname and service resolvable? */
+    if (rc) {
+        fail(ctx, src, HTP_ERR_RESOLVE, "%s host or service unavailable", src->name);
+        return;
+    }
+
+    /* The lookup of an expanded host only checks its address */
+    if (src->group >= 0) {
+        rc = repin(ctx, src, res, &now);
+        freeaddrinfo(res);
+        if (rc) {
+            fail(ctx, src, HTP_ERR_RESOLVE, "%s no address left for %s", src->name, src->host);
+            return;
+        }
+        conn->res = conn->ai = &src->pin;
+        conn->ownres = 0;
+        startconnect(ctx, src);
+        return;
+    }
+
+    conn->res = res;
+    conn->ownres = 1;
+    if (ctx->arena.base != NULL) {
+        conn->res = arenacopy(&ctx->arena, res);
+        conn->ownres = 0;
+        freeaddrinfo(res);
+        if (conn->res == NULL) {
+            fail(ctx, src, HTP_ERR_MEMORY, "%s arena exhausted", src->name);
+            return;
+        }
+    }
+    conn->ai = conn->res;
+    startconnect(ctx, src);
+}
+
+
+/* Start connecting to the next address of the web server or proxy */
+static void startconnect(struct htp_ctx *ctx, struct source *src) {
+    struct conn     *conn = src->conn;
+
+    /* An expanded host is resolved again for every measurement, but
+       reconnects to the same address while one is under way, or if no
+       lookup can be started
+    */
+    if (conn->res == NULL && src->group >= 0 && src->result.requests > 0) {
+        conn->res = conn->ai = &src->pin;
+        conn->ownres = 0;
+    }
+
+    if (conn->res == NULL) {
+        if (startlookup(ctx, src) == 0) return;
+        if (src->pin.ai_addr == NULL) {
+            fail(ctx, src, HTP_ERR_RESOLVE, "%s name resolution unavailable", src->name);
+            return;
+        }
+        conn->res = conn->ai = &src->pin;
+        conn->ownres = 0;
+    }
+
+    /* Loop through the available addresses */
+    for (; conn->ai != NULL; conn->ai = conn->ai->ai_next) {
+        conn->fd = socket(conn->ai->ai_family, conn->ai->ai_socktype, conn->ai->ai_protocol);
+        if (conn->fd < 0) continue;
+
+        fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+        clock_gettime(CLOCK_REALTIME, &conn->start);
+        if (connect(conn->fd, conn->ai->ai_addr, conn->ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            src->deadline = conn->start;
+            nsadd(&src->deadline, (long long)ctx->opt.timeout * 1000000);
+            setphase(src, ST_CONNECT, POLLOUT);
+            return;
+        }
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    fail(ctx, src, HTP_ERR_CONNECT, "%s connection failed", src->name);
+}
+
+
+/* The connection is ready for requests, schedule the next one */
+static void ready(struct htp_ctx *ctx, struct source *src) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    bisect_schedule(&src->b, &now, &src->at);
+
+    /* HTTP/2 servers may send SETTINGS or PING frames at any time */
+    #ifdef ENABLE_HTTPS
+    if (src->conn->use_h2) {
+        setphase(src, ST_WAIT, POLLIN | (src->conn->h2.outlen ? POLLOUT : 0));
+        return;
+    }
+    #endif
+    setphase(src, ST_WAIT, 0);
+}
+
+
+#ifdef ENABLE_HTTPS
+static void starttls(struct htp_ctx *ctx, struct source *src);
+static int sendframes(struct source *src);
+
+
+/* Read the response of the proxy server to CONNECT, but nothing beyond
+   its headers as the rest of the stream belongs to the tunneled connection
+*/
+static void proxyCONNECT(struct htp_ctx *ctx, struct source *src) {
+    struct conn     *conn = src->conn;
+    struct timespec now;
+    char            *end = NULL;
+    int             n, status = 0;
+
+    while (end == NULL && conn->length < BUFFERSIZE - 1) {
+        n = (int)recv(conn->fd, conn->buffer + conn->length, BUFFERSIZE - 1 - conn->length, MSG_PEEK);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) break;
+        conn->buffer[conn->length + (size_t)n] = '\0';
+        if ((end = strstr(conn->buffer, "\r\n\r\n")) != NULL)
+            n = (int)(end + 4 - conn->buffer) - (int)conn->length;
+        n = (int)recv(conn->fd, conn->buffer + conn->length, (size_t)n, 0);
+        if (n <= 0) break;
+        conn->length += (size_t)n;
+        conn->buffer[conn->length] = '\0';
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if (end == NULL || sscanf(conn->buffer, "HTTP/%*u.%*u %d", &status) != 1 || status / 100 != 2) {
+        conn->buffer[conn->length] = '\0';
+        fail(ctx, src, HTP_ERR_PROXY, "Proxy error: %s:%s\r\n%s", ctx->proxy, ctx->proxyport, conn->buffer);
+        return;
+    }
+
+    PHASE(ctx, src, proxy, PH_PROXY, &src->sent, &now);
+    if (ctx->opt.debug)
+        htplog(ctx, 0, "%-25s %s, tunnel via %s:%s (%lli ms)", src->name, src->port,
+            ctx->proxy, ctx->proxyport, nsdiff(&now, &src->sent) / 1000000);
+    conn->length = 0;
+    starttls(ctx, src);
+}
+
+
+#if defined SSL_OP_ENABLE_KTLS && !defined OPENSSL_NO_KTLS
+static const char *const ktlsname[] = {"not available (tls module, cipher)", "send", "receive", "send and receive"};
+#endif
+
+
+static void handshake(struct htp_ctx *ctx, struct source *src) {
+    struct conn         *conn = src->conn;
+    const unsigned char *alpn;
+    unsigned int        alpnlen;
+    struct timespec     now;
+    int                 rc = SSL_connect(conn->ssl);
+
+    if (rc != 1) {
+        switch (SSL_get_error(conn->ssl, rc)) {
+            case SSL_ERROR_WANT_READ:
+                src->events = POLLIN;
+                return;
+            case SSL_ERROR_WANT_WRITE:
+                src->events = POLLOUT;
+                return;
+            default:
+                fail(ctx, src, HTP_ERR_TLS, "TLS error %s", src->name);
+                return;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    PHASE(ctx, src, tls, PH_TLS, &src->sent, &now);
+
+    /* With kTLS, SSL_write and SSL_read pass the plain text to the
+       socket and the kernel does the record encryption
+    */
+    #if defined SSL_OP_ENABLE_KTLS && !defined OPENSSL_NO_KTLS
+    if (ctx->opt.ktls) {
+        conn->ktls = (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) ? 1 : 0)
+            | (BIO_get_ktls_recv(SSL_get_rbio(conn->ssl)) ? 2 : 0);
+        if (ctx->opt.debug)
+            htplog(ctx, 0, "%s kTLS %s", src->name, ktlsname[conn->ktls]);
+    }
+    #endif
+
+    /* All requests become streams on this one connection */
+    SSL_get0_alpn_selected(conn->ssl, &alpn, &alpnlen);
+    if (alpnlen == 2 && memcmp(alpn, "h2", 2) == 0) {
+        conn->use_h2 = 1;
+        conn->stream = 1;
+        h2_init(&conn->h2);
+        conn->h2.outlen = h2_preface(conn->h2.out);
+        if (sendframes(src)) {
+            fail(ctx, src, HTP_ERR_HTTP, "HTTP/2 error %s", src->name);
+            return;
+        }
+        if (ctx->opt.debug) htplog(ctx, 0, "%s using HTTP/2", src->name);
+    }
+
+    ready(ctx, src);
+}
+
+
+static void starttls(struct htp_ctx *ctx, struct source *src) {
+    struct conn *conn = src->conn;
+
+    conn->use_h2 = 0;
+    conn->readblocked = 0;
+    conn->ktls = 0;
+    conn->ssl = SSL_new(ctx->tls);
+    if (conn->ssl == NULL || !SSL_set_fd(conn->ssl, conn->fd)) {
+        fail(ctx, src, HTP_ERR_TLS, "TLS error %s", src->name);
+        return;
+    }
+    SSL_set_tlsext_host_name(conn->ssl, src->host);
+    clock_gettime(CLOCK_REALTIME, &src->sent);
+
+    src->deadline = conn->start;
+    nsadd(&src->deadline, (long long)ctx->opt.timeout * 1000000);
+    setphase(src, ST_TLS, POLLOUT);
+    handshake(ctx, src);
+}
+
+
+/* Send the queued preface and acknowledgements, or wait for POLLOUT */
+static int sendframes(struct source *src) {
+    struct conn *conn = src->conn;
+    int         n;
+
+    if (conn->h2.outlen == 0) return 0;
+    n = SSL_write(conn->ssl, conn->h2.out, (int)conn->h2.outlen);
+    if (n > 0) {
+        conn->h2.outlen = 0;
+        src->events &= ~POLLOUT;
+        return 0;
+    }
+    switch (SSL_get_error(conn->ssl, n)) {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+            src->events |= POLLOUT;
+            return 0;
+    }
+    return -1;
+}
+
+
+/* Read HTTP/2 frames, returns 1 when the response headers of the
+   stream are complete, 0 to wait for more and -1 on errors
+*/
+static int readframes(struct htp_ctx *ctx, struct source *src) {
+    struct conn *conn = src->conn;
+    int         n;
+    long        used;
+
+    while (conn->pending < BUFFERSIZE) {
+        n = SSL_read(conn->ssl, conn->frames + conn->pending, (int)(BUFFERSIZE - conn->pending));
+        if (n <= 0) {
+            switch (SSL_get_error(conn->ssl, n)) {
+                case SSL_ERROR_WANT_READ:
+                    return 0;
+                case SSL_ERROR_WANT_WRITE:
+                    /* e.g. answering a key update, retried on POLLOUT */
+                    conn->readblocked = 1;
+                    src->events |= POLLOUT;
+                    return 0;
+            }
+            return -1;
+        }
+        conn->pending += (size_t)n;
+
+        used = h2_input(&conn->h2, conn->frames, conn->pending, conn->buffer, BUFFERSIZE);
+        if (used < 0) {
+            htplog(ctx, 1, "HTTP/2 protocol error");
+            return -1;
+        }
+        conn->pending -= (size_t)used;
+        memmove(conn->frames, conn->frames + used, conn->pending);
+
+        /* Acknowledge SETTINGS and PING frames */
+        if (sendframes(src)) return -1;
+        if (src->state == ST_RECV && conn->h2.done) return 1;
+    }
+
+    return -1;
+}
+#endif
+
+
+/* Read the response headers, returns 1 when complete, 0 to wait for
+   more and -1 on errors or when the connection was closed
+*/
+static int readresponse(struct htp_ctx *ctx, struct source *src) {
+    struct conn *conn = src->conn;
+    int         n;
+
+    #ifdef ENABLE_HTTPS
+    if (conn->use_h2) return readframes(ctx, src);
+    #endif
+
+    while (conn->length < BUFFERSIZE - 1) {
+        #ifdef ENABLE_HTTPS
+        if (conn->ssl) {
+            n = SSL_read(conn->ssl, conn->buffer + conn->length, (int)(BUFFERSIZE - 1 - conn->length));
+            if (n <= 0)
+                return SSL_get_error(conn->ssl, n) == SSL_ERROR_WANT_READ ? 0 : -1;
+        } else
+        #endif
+        {
+            /* Receive data from the web server
+               The return code from recv() is the number of bytes received
+            */
+            n = (int)recv(conn->fd, conn->buffer + conn->length, BUFFERSIZE - 1 - conn->length, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            if (n <= 0) return -1;
+        }
+        conn->length += (size_t)n;
+        conn->buffer[conn->length] = '\0';
+        if (strstr(conn->buffer, "\r\n\r\n")) return 1;  /* end of HTTP headers */
+    }
+
+    return 1;
+}
+
+
+/* Keep a request of the measurement for the capture file */
+static void capturesample(struct htp_ctx *ctx, struct source *src, const struct timespec *received, long long date) {
+    struct conn             *conn = src->conn;
+    struct capture_record   *r;
+
+    if (ctx->opt.capture == NULL || conn->nrecords >= MAX_CAPTURE) return;
+
+    r = &conn->records[conn->nrecords];
+    r->server = (uint32_t)src->id;
+    r->step = conn->nrecords++;
+    r->when = (int32_t)src->b.when;
+    r->nap = (int32_t)src->b.nap;
+    r->launch = (int64_t)src->at.tv_sec * HTP_NS + src->at.tv_nsec;
+    r->sent = (int64_t)src->sent.tv_sec * HTP_NS + src->sent.tv_nsec;
+    r->received = (int64_t)received->tv_sec * HTP_NS + received->tv_nsec;
+    r->rtt = r->received - r->sent;
+    r->date = date;
+}
+
+
+/* The web server asks to come back later (429 or 503), after the
+   Retry-After delay or HTTP-date, otherwise after an exponential backoff
+*/
+static void busy(struct htp_ctx *ctx, struct source *src, int status, time_t now) {
+    const char  *p = getheader(src->conn->buffer, "Retry-After");
+    char        date[25] = {'\0'};
+    long        delay = 0;
+
+    if (p != NULL && isdigit((unsigned char)*p)) {
+        delay = atol(p);
+    } else if (p != NULL && strlen(p) >= 29) {
+        strncpy(date, p + 5, 24);
+        delay = (long)(getremotetime(ctx, date) - now);
+    }
+
+    src->backoff = src->backoff ? src->backoff * 2 : MIN_BACKOFF;
+    if (src->backoff > MAX_BACKOFF) src->backoff = MAX_BACKOFF;
+    if (delay <= 0) delay = src->backoff;
+    if (delay > MAX_BACKOFF) delay = MAX_BACKOFF;
+    src->holdoff = now + delay;
+
+    fail(ctx, src, HTP_ERR_BUSY, "%s busy (HTTP %d), retry in %ld s", src->name, status, delay);
+}
+
+
+/* A complete response, received at "received" */
+static void response(struct htp_ctx *ctx, struct source *src, const struct timespec *received) {
+    struct conn     *conn = src->conn;
+    char            *pdate;
+    char            remote_time[25] = {'\0'};
+    struct timespec start, now;
+    long long       rtt = nsdiff(received, &src->sent), date;
+    long            age;
+    int             status;
+    double          offset;
+
+    clock_gettime(CLOCK_REALTIME, &start);
+    src->b.net = netrtt(ctx, src);
+
+    if ((status = httpstatus(conn->buffer)) == 429 || status == 503) {
+        busy(ctx, src, status, received->tv_sec);
+        return;
+    }
+
+    if ((age = cacheage(ctx, src, conn->buffer)) > 0) {
+        fail(ctx, src, HTP_ERR_STALE, "%s cached response, Age %ld s", src->name, age);
+        return;
+    }
+
+    /* A high resolution timestamp makes bisection unnecessary */
+    src->b.rtt = (long)rtt;
+    if (src->hires && gethires(src, conn->buffer, received, rtt - bisect_latency(&src->b), &offset) == 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        PHASE(ctx, src, parse, PH_PARSE, &start, &now);
+        if (ctx->opt.debug)
+            htplog(ctx, 0, "%-25s %s, %s (%lli ms) => %.6f", src->name, src->port,
+                src->hires, rtt / 1000000, offset);
+        capturesample(ctx, src, received, 0);
+        src->result.hires = 1;
+        finish(ctx, src, HTP_OK, offset);
+        return;
+    }
+
+    /* Look for the line that contains [dD]ate: */
+    if ((pdate = strcasestr(conn->buffer, "date: ")) == NULL || strlen(pdate) < 35) {
+        fail(ctx, src, HTP_ERR_TIMESTAMP, "%s no timestamp", src->name);
+        return;
+    }
+
+    if (ctx->opt.debug > 2) htplog(ctx, 0, "%s", conn->buffer);
+    strncpy(remote_time, pdate + 11, 24);
+    date = getremotetime(ctx, remote_time);
+    clock_gettime(CLOCK_REALTIME, &now);
+    PHASE(ctx, src, parse, PH_PARSE, &start, &now);
+
+    /* Print host, raw timestamp, round trip time */
+    if (ctx->opt.debug)
+        htplog(ctx, 0, "%-25s %s, %s (%lli ms) => %lli", src->name, src->port,
+            remote_time, rtt / 1000000, (long long)received->tv_sec - date);
+    capturesample(ctx, src, received, date);
+
+    bisect_sample(&src->b, &src->sent, received, date);
+    if (bisect_stale(&src->b))
+        fail(ctx, src, HTP_ERR_STALE, "%s stale Date, not advancing with time", src->name);
+    else if (src->b.precision >= 1)
+        ready(ctx, src);
+    else
+        finish(ctx, src, HTP_OK, bisect_result(&src->b));
+}
+
+
+/* A kept connection may have been closed by the other side in the
+   meantime, connect once more before giving up
+*/
+static void connlost(struct htp_ctx *ctx, struct source *src) {
+    if (src->reused) {
+        src->reused = 0;
+        closeconn(ctx, src);
+        if (ctx->opt.debug) htplog(ctx, 0, "%s connection closed, reconnecting", src->name);
+        startconnect(ctx, src);
+        return;
+    }
+    fail(ctx, src, HTP_ERR_HTTP, "error from %s:%s", src->name, src->port);
+}
+
+
+static void sendrequest(struct htp_ctx *ctx, struct source *src) {
+    struct conn *conn = src->conn;
+    int         ok;
+
+    if (ctx->opt.debug > 1)
+        htplog(ctx, 0, "bisect: %i, when: %09li", src->b.polls, src->b.when);
+
+    /* OpenSSL takes no other write while queued frames are to be
+       retried, the request waits for its moment in the next second
+    */
+    #ifdef ENABLE_HTTPS
+    if (conn->use_h2) {
+        if (sendframes(src)) {
+            connlost(ctx, src);
+            return;
+        }
+        if (conn->h2.outlen) {
+            ready(ctx, src);
+            return;
+        }
+    }
+    #endif
+
+    conn->length = 0;
+    conn->buffer[0] = '\0';
+
+    /* Send HEAD request */
+    clock_gettime(CLOCK_REALTIME, &src->sent);
+    PHASE(ctx, src, send, PH_SEND, &src->at, &src->sent);
+    src->firstbyte.tv_sec = 0;
+    #ifdef ENABLE_HTTPS
+    if (conn->use_h2) {
+        h2_stream(src->h2request, conn->stream);
+        conn->h2.stream = conn->stream;
+        conn->h2.done = 0;
+        conn->stream += 2;
+        ok = src->h2length && SSL_write(conn->ssl, src->h2request, (int)src->h2length) > 0;
+    } else if (conn->ssl) {
+        ok = SSL_write(conn->ssl, src->headrequest, (int)src->headlength) > 0;
+    } else
+    #endif
+    ok = send(conn->fd, src->headrequest, src->headlength, MSG_NOSIGNAL) == (ssize_t)src->headlength;
+
+    if (!ok) {
+        connlost(ctx, src);
+        return;
+    }
+
+    src->result.requests++;
+    if (ctx->opt.budget) src->tokens--;
+    src->deadline = src->sent;
+    nsadd(&src->deadline, (long long)ctx->opt.timeout * 1000000);
+    setphase(src, ST_RECV, POLLIN);
+}
+
+
+static void connected(struct htp_ctx *ctx, struct source *src) {
+    struct conn     *conn = src->conn;
+    struct timespec now;
+    int             error = 0;
+    socklen_t       len = sizeof(error);
+
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+        close(conn->fd);
+        conn->fd = -1;
+        conn->ai = conn->ai->ai_next;
+        startconnect(ctx, src);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    PHASE(ctx, src, connect, PH_CONNECT, &conn->start, &now);
+    freeres(conn);
+
+    /* The proxy hop, as opposed to the round trip to the web server */
+    if (ctx->proxy && ctx->opt.debug)
+        htplog(ctx, 0, "%-25s %s, proxy %s:%s (%lli ms)", src->name, src->port,
+            ctx->proxy, ctx->proxyport, nsdiff(&now, &conn->start) / 1000000);
+
+    #ifdef ENABLE_HTTPS
+    if (src->scheme) {
+        if (ctx->proxy) {
+            src->sent = now;
+            conn->length = 0;
+            if (send(conn->fd, src->connectrequest, src->connectlength, MSG_NOSIGNAL) < 0) {
+                fail(ctx, src, HTP_ERR_PROXY, "Error sending");
+                return;
+            }
+            setphase(src, ST_PROXY, POLLIN);
+            return;
+        }
+        starttls(ctx, src);
+        return;
+    }
+    #endif
+
+    ready(ctx, src);
+}
+
+
+/* Make progress on a source after poll() reported events */
+static void handle(struct htp_ctx *ctx, struct source *src, short revents) {
+    struct timespec received;
+    int             rc;
+
+    /* Queued HTTP/2 frames can go out now, and a read that had to
+       write first continues
+    */
+    #ifdef ENABLE_HTTPS
+    if ((src->state == ST_WAIT || src->state == ST_RECV) && src->conn->use_h2 && revents & POLLOUT) {
+        src->events &= ~POLLOUT;
+        if (sendframes(src)) {
+            connlost(ctx, src);
+            return;
+        }
+        if (src->conn->readblocked) {
+            src->conn->readblocked = 0;
+            revents |= POLLIN;
+        }
+        if (!(revents & ~POLLOUT)) return;
+    }
+    #endif
+
+    switch (src->state) {
+        case ST_RESOLVE:
+            resolved(ctx, src);
+            break;
+        case ST_CONNECT:
+            connected(ctx, src);
+            break;
+        #ifdef ENABLE_HTTPS
+        case ST_PROXY:
+            proxyCONNECT(ctx, src);
+            break;
+        case ST_TLS:
+            handshake(ctx, src);
+            break;
+        #endif
+        case ST_WAIT:
+            /* Only HTTP/2 control frames are expected here */
+            #ifdef ENABLE_HTTPS
+            if (src->conn->use_h2 && !(revents & (POLLERR | POLLNVAL)) && readframes(ctx, src) == 0)
+                break;
+            #endif
+            connlost(ctx, src);
+            break;
+        case ST_RECV:
+            if (src->firstbyte.tv_sec == 0) {
+                clock_gettime(CLOCK_REALTIME, &src->firstbyte);
+                PHASE(ctx, src, ttfb, PH_TTFB, &src->sent, &src->firstbyte);
+            }
+            rc = readresponse(ctx, src);
+            clock_gettime(CLOCK_REALTIME, &received);
+            if (rc > 0) {
+                PHASE(ctx, src, headers, PH_HEADERS, &src->firstbyte, &received);
+                response(ctx, src, &received);
+            }
+            else if (rc < 0)
+                connlost(ctx, src);
+            break;
+    }
+}
+
+
+/* The next source has a (kept) connection or one is available */
+static int startable(const struct htp_ctx *ctx) {
+    return ctx->next < ctx->nsources && (ctx->free || ctx->sources[ctx->next]->conn);
+}
+
+
+/* Refill the request budget of a source, spread over the hour */
+static double budget(const struct htp_ctx *ctx, struct source *src, time_t now) {
+    src->tokens += (double)(now - src->refilled) * ctx->opt.budget / 3600;
+    if (src->tokens > ctx->opt.budget) src->tokens = ctx->opt.budget;
+    src->refilled = now;
+    return src->tokens;
+}
+
+
+/* Take a connection from the pool and start measuring a source */
+static int activate(struct htp_ctx *ctx, struct source *src) {
+    struct timespec now;
+    int             need;
+
+    if (src->conn == NULL) {
+        if (ctx->free == NULL) return -1;
+        src->conn = ctx->free;
+        ctx->free = src->conn->next;
+        src->conn->fd = -1;
+        src->conn->res = NULL;
+        src->conn->lookup = NULL;
+        #ifdef ENABLE_HTTPS
+        src->conn->ssl = NULL;
+        src->conn->use_h2 = 0;
+        src->conn->readblocked = 0;
+        src->conn->ktls = 0;
+        #endif
+    }
+    src->conn->nrecords = 0;
+    src->conn->length = 0;
+    ctx->act[ctx->nact++] = src;
+    src->result.status = HTP_RUNNING;
+
+    /* Skip a web server that asked for a break, or whose budget can't
+       pay for a measurement. Tracking reserves the full bisection it
+       falls back to.
+    */
+    clock_gettime(CLOCK_REALTIME, &now);
+    need = src->b.precision + 1;
+    if (src->b.tracking) need += src->b.tracking;
+    if (src->holdoff > now.tv_sec)
+        fail(ctx, src, HTP_ERR_BUSY, "%s busy, retry in %ld s", src->name, (long)(src->holdoff - now.tv_sec));
+    else if (ctx->opt.budget && budget(ctx, src, now.tv_sec) < need)
+        fail(ctx, src, HTP_ERR_BUDGET, "%s request budget exhausted", src->name);
+    else if (src->conn->fd >= 0)
+        ready(ctx, src);
+    else
+        startconnect(ctx, src);
+
+    /* Failed right away, e.g. name resolution */
+    if (src->state == ST_DONE) ctx->nact--;
+    return 0;
+}
+
+
+/* Start sources while the connection budget allows */
+static void startpending(struct htp_ctx *ctx) {
+    while (startable(ctx)) activate(ctx, ctx->sources[ctx->next++]);
+}
+
+
+#ifdef __linux__
+/* Mirror the poll events and the next deadline in the epoll set */
+static void syncepoll(struct htp_ctx *ctx, const struct timespec *due) {
+    struct epoll_event  ev;
+    struct itimerspec   its;
+    int                 i;
+
+    for (i = 0; i < ctx->nact; i++) {
+        struct source *src = ctx->act[i];
+
+        if (src->conn == NULL || src->conn->fd < 0 || src->epevents == src->events) continue;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (uint32_t)((src->events & POLLIN ? EPOLLIN : 0) | (src->events & POLLOUT ? EPOLLOUT : 0));
+        ev.data.fd = src->conn->fd;
+        if (epoll_ctl(ctx->epfd, src->epevents < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, src->conn->fd, &ev) == 0)
+            src->epevents = src->events;
+    }
+
+    memset(&its, 0, sizeof(its));
+    if (due) its.it_value = *due;
+    if (due && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(ctx->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+#endif
+
+
+/* Earliest moment htp_step() has something to do, NULL if nothing */
+static const struct timespec *nextdue(const struct htp_ctx *ctx, struct timespec *due) {
+    const struct timespec   *first = NULL, *t;
+    int                     i;
+
+    if (startable(ctx)) {
+        clock_gettime(CLOCK_REALTIME, due);
+        return due;
+    }
+
+    for (i = 0; i < ctx->nact; i++) {
+        const struct source *src = ctx->act[i];
+
+        t = src->state == ST_WAIT ? &src->at : &src->deadline;
+        if (first == NULL || nsdiff(t, first) < 0) first = t;
+    }
+    if (first) *due = *first;
+    return first ? due : NULL;
+}
+
+
+static int pollset(struct htp_ctx *ctx) {
+    int i;
+
+    for (i = 0; i < ctx->nact; i++) {
+        const struct source *src = ctx->act[i];
+
+        ctx->pfd[i].fd = src->conn && src->conn->fd >= 0 ? src->conn->fd : -1;
+        ctx->pfd[i].events = src->events;
+        ctx->pfd[i].revents = 0;
+    }
+    return ctx->nact;
+}
+
+
+void htp_defaults(struct htp_options *opt) {
+    memset(opt, 0, sizeof(*opt));
+    opt->precision = DEFAULT_PRECISION;
+    opt->httpversion = 1;
+    opt->timeout = DEFAULT_TIMEOUT;
+}
+
+
+struct htp_ctx *htp_new(const struct htp_options *opt) {
+    struct htp_ctx  *ctx = calloc(1, sizeof(struct htp_ctx));
+    char            *scheme, *path;
+
+    if (ctx == NULL) return NULL;
+    ctx->opt = *opt;
+    ctx->epfd = ctx->tfd = -1;
+    if (ctx->opt.timeout <= 0) ctx->opt.timeout = DEFAULT_TIMEOUT;
+
+    if (opt->proxy) {
+        ctx->proxy = ctx->proxyurl = strdup(opt->proxy);
+        ctx->proxyport = DEFAULT_PROXY_PORT;
+        if (ctx->proxy == NULL) {
+            htp_free(ctx);
+            return NULL;
+        }
+        splitURL(&scheme, &ctx->proxy, &ctx->proxyport, &path, &ctx->proxyauth);
+    }
+
+    if (opt->arena && arena_init(&ctx->arena, opt->arena)) {
+        htp_free(ctx);
+        return NULL;
+    }
+
+    #ifdef ENABLE_HTTPS
+    SSL_library_init();
+    ctx->tls = SSL_CTX_new(TLS_method());
+    if (ctx->tls == NULL) {
+        htp_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_default_verify_paths(ctx->tls);
+    SSL_CTX_set_verify_depth(ctx->tls, 4);
+    if (opt->verifycert) SSL_CTX_set_verify(ctx->tls, SSL_VERIFY_PEER, NULL);
+
+    /* Offer HTTP/2 next to HTTP/1.1 during the TLS handshake (ALPN) */
+    if (opt->http2)
+        SSL_CTX_set_alpn_protos(ctx->tls, (const unsigned char *)H2_ALPN, sizeof(H2_ALPN) - 1);
+
+    /* Kernel TLS after the handshake, if the kernel and cipher allow */
+    #if defined SSL_OP_ENABLE_KTLS && !defined OPENSSL_NO_KTLS
+    if (opt->ktls) SSL_CTX_set_options(ctx->tls, SSL_OP_ENABLE_KTLS);
+    #else
+    if (opt->ktls) htplog(ctx, 1, "kTLS not supported by OpenSSL, using userspace TLS");
+    #endif
+    #endif
+
+    return ctx;
+}
+
+
+void htp_free(struct htp_ctx *ctx) {
+    struct conn *conn;
+    int         i;
+
+    if (ctx == NULL) return;
+
+    /* Sources under way end with a callback, the ones not started don't */
+    if (ctx->running) {
+        ctx->next = ctx->nsources;
+        htp_stop(ctx);
+    }
+    for (i = 0; i < ctx->nsources; i++) {
+        releaseconn(ctx, ctx->sources[i]);
+        free(ctx->sources[i]->url);
+        free(ctx->sources[i]);
+    }
+    while ((conn = ctx->free) != NULL) {
+        ctx->free = conn->next;
+        free(conn);
+    }
+    #ifdef ENABLE_HTTPS
+    if (ctx->tls) SSL_CTX_free(ctx->tls);
+    #endif
+    if (ctx->epfd >= 0) close(ctx->epfd);
+    if (ctx->tfd >= 0) close(ctx->tfd);
+    if (ctx->arena.base) arena_free(&ctx->arena);
+    free(ctx->proxyurl);
+    free(ctx->sources);
+    free(ctx->act);
+    free(ctx->pfd);
+    free(ctx);
+}
+
+
+/* Add a web server, [http[s]://][user:pass@]host[:port][/path][#header[=s|ms|us|ns]]
+   Returns its index, or -1 on errors
+*/
+int htp_add_source(struct htp_ctx *ctx, const char *url) {
+    struct source **sources, *src;
+
+    if (ctx->running) return -1;
+
+    if (ctx->nsources == ctx->size) {
+        sources = realloc(ctx->sources, (size_t)(ctx->size ? ctx->size * 2 : 16) * sizeof(struct source *));
+        if (sources == NULL) return -1;
+        ctx->sources = sources;
+        ctx->size = ctx->size ? ctx->size * 2 : 16;
+    }
+
+    if ((src = calloc(1, sizeof(struct source))) == NULL) return -1;
+    if ((src->url = strdup(url)) == NULL || initsource(ctx, src)) {
+        free(src->url);
+        free(src);
+        return -1;
+    }
+    src->id = ctx->nsources;
+    src->epevents = -1;
+    src->group = -1;
+    src->result.offset = HTP_ERROR;
+    src->tokens = ctx->opt.budget;
+    src->refilled = time(NULL);
+    src->name = src->host;
+    src->result.host = src->host;
+    src->result.port = src->port;
+    ctx->sources[ctx->nsources] = src;
+    return ctx->nsources++;
+}
+
+
+/* Add a web server once for every address of its host, at most max,
+   each measured over its own connection with the same Host header and
+   SNI. Through a proxy, which resolves the host itself, it is added once.
+   The host is resolved again for every measurement, see repin().
+   Returns the number of sources added, or -1 on errors
+*/
+int htp_expand_source(struct htp_ctx *ctx, const char *url, int max) {
+    struct addrinfo hints, *res, *ai;
+    struct source   *src;
+    int             first, i, n = 0;
+
+    if ((first = htp_add_source(ctx, url)) < 0) return -1;
+    src = ctx->sources[first];
+    if (ctx->proxy != NULL || max < 2) return 1;
+
+    sethints(ctx, &hints);
+    hints.ai_flags = 0;
+    if (getaddrinfo(src->host, src->port, &hints, &res)) {
+        htplog(ctx, 1, "%s host or service unavailable", src->host);
+        return 1;
+    }
+
+    for (ai = res; ai != NULL && n < max; ai = ai->ai_next) {
+        /* Every address once */
+        for (i = first; i < first + n; i++) {
+            if (pinned(ctx->sources[i], ai)) break;
+        }
+        if (i < first + n) continue;
+
+        if (n > 0 && htp_add_source(ctx, url) < 0) break;
+        pin(ctx->sources[first + n], ai);
+        ctx->sources[first + n]->group = first;
+        if (ctx->opt.debug) htplog(ctx, 0, "%s address %s", src->host, ctx->sources[first + n]->address);
+        n++;
+    }
+    freeaddrinfo(res);
+    return n > 0 ? n : 1;
+}
+
+
+int htp_sources(const struct htp_ctx *ctx) {
+    return ctx->nsources;
+}
+
+
+/* Start a measurement of all sources */
+int htp_start(struct htp_ctx *ctx) {
+    struct pollfd   pfd;
+    struct conn     *conn;
+    struct timespec now;
+    int             i, n;
+
+    if (ctx->running) return -1;
+
+    /* The pool has a connection for every source that can be active */
+    n = ctx->opt.maxactive > 0 && ctx->opt.maxactive < ctx->nsources ? ctx->opt.maxactive : ctx->nsources;
+    if (n > 0 && ctx->nconns < n) {
+        struct source   **act = realloc(ctx->act, (size_t)n * sizeof(struct source *));
+        struct pollfd   *pfds;
+
+        if (act == NULL) return -1;
+        ctx->act = act;
+        if ((pfds = realloc(ctx->pfd, (size_t)n * sizeof(struct pollfd))) == NULL) return -1;
+        ctx->pfd = pfds;
+        for (; ctx->nconns < n; ctx->nconns++) {
+            if ((conn = calloc(1, sizeof(struct conn))) == NULL) return -1;
+            conn->next = ctx->free;
+            ctx->free = conn;
+        }
+    }
+    ctx->keep = ctx->proxy != NULL && n == ctx->nsources;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = 0; i < ctx->nsources; i++) {
+        struct source *src = ctx->sources[i];
+
+        setphase(src, ST_PENDING, 0);
+        src->reused = 0;
+        src->result.status = HTP_IDLE;
+        src->result.offset = HTP_ERROR;
+        src->result.rtt = 0;
+        src->result.network = src->result.server = 0;
+        src->result.requests = src->result.precision = 0;
+        src->result.hires = 0;
+        src->result.http2 = 0;
+        src->result.ktls = 0;
+        startbisect(ctx, src, &now);
+
+        /* A connection kept from the previous measurement is only usable
+           if the other side didn't close it (or sent anything) in the meantime
+        */
+        if (src->conn != NULL && src->conn->fd >= 0) {
+            pfd.fd = src->conn->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, 0) != 0) {
+                if (ctx->opt.debug) htplog(ctx, 0, "%s connection closed, reconnecting", src->name);
+                closeconn(ctx, src);
+            } else {
+                src->reused = 1;
+            }
+        }
+    }
+
+    memset(ctx->hist, 0, sizeof(ctx->hist));
+
+    /* Nothing of the previous measurement is left in the arena */
+    if (ctx->arena.base) arena_reset(&ctx->arena);
+    #ifdef ENABLE_HTTPS
+    ctx->tlsmark = tlsallocs;
+    #endif
+
+    ctx->next = 0;
+    ctx->nact = 0;
+    ctx->running = ctx->nsources;
+    return 0;
+}
+
+
+/* How late a request may still go out: a quarter of the step of the
+   bisection, or of the tracking window
+*/
+static long long latebound(const struct bisect *b) {
+    long long ns = (b->tracking ? b->half : labs(b->nap)) / 4;
+
+    return ns > LATE_NS ? ns : LATE_NS;
+}
+
+
+/* Make progress on all sources that are ready, without waiting for the
+   network. Returns the number of sources still being measured.
+*/
+int htp_step(struct htp_ctx *ctx) {
+    struct timespec now, due;
+    long long       ns;
+    uint64_t        expirations;
+    int             i, n, active;
+
+    if (ctx->tfd >= 0 && read(ctx->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        htplog(ctx, 1, "timerfd: %s", strerror(errno));
+
+    startpending(ctx);
+
+    n = pollset(ctx);
+    if (n && poll(ctx->pfd, (nfds_t)n, 0) > 0) {
+        for (i = 0; i < n; i++) {
+            if (ctx->pfd[i].revents && ctx->act[i]->state != ST_DONE && ctx->pfd[i].fd == ctx->act[i]->conn->fd)
+                handle(ctx, ctx->act[i], ctx->pfd[i].revents);
+        }
+    }
+
+    /* Sleep once, until the earliest request due within SPIN_NS */
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = 0, ns = SPIN_NS + 1; i < ctx->nact; i++) {
+        if (ctx->act[i]->state == ST_WAIT && nsdiff(&ctx->act[i]->at, &now) < ns)
+            ns = nsdiff(&ctx->act[i]->at, &now);
+    }
+    if (ns > 0 && ns <= SPIN_NS) {
+        struct timespec sleepspec = {0, (long)ns};
+        nanosleep(&sleepspec, NULL);
+    }
+
+    /* Send requests that are due, give up on the ones that take too long */
+    for (i = 0; i < ctx->nact; i++) {
+        struct source *src = ctx->act[i];
+
+        if (src->state == ST_DONE) continue;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (src->state == ST_WAIT) {
+            ns = nsdiff(&now, &src->at);
+            if (ns < 0) continue;
+            if (ns > latebound(&src->b)) {
+                /* Off target it would mislead the bisection */
+                if (ctx->opt.debug > 1)
+                    htplog(ctx, 0, "%s request %lli us late, next second", src->name, ns / 1000);
+                bisect_schedule(&src->b, &now, &src->at);
+                continue;
+            }
+            sendrequest(ctx, src);
+        } else if (nsdiff(&now, &src->deadline) >= 0) {
+            fail(ctx, src, HTP_ERR_TIMEOUT, "%s timeout", src->name);
+        }
+    }
+
+    /* Sources done make room for new ones */
+    for (i = active = 0; i < ctx->nact; i++) {
+        if (ctx->act[i]->state != ST_DONE) ctx->act[active++] = ctx->act[i];
+    }
+    ctx->nact = active;
+    startpending(ctx);
+
+    #ifdef __linux__
+    if (ctx->epfd >= 0) syncepoll(ctx, nextdue(ctx, &due));
+    #else
+    (void)due;
+    #endif
+
+    return ctx->running;
+}
+
+
+static void cancel(struct htp_ctx *ctx, struct source *src) {
+    releaseconn(ctx, src);
+    src->result.status = HTP_CANCELLED;
+    setphase(src, ST_DONE, 0);
+    if (ctx->opt.done) ctx->opt.done(ctx->opt.donearg, src->id, &src->result);
+}
+
+
+/* Cancel the measurement of all sources not done yet */
+void htp_stop(struct htp_ctx *ctx) {
+    int i;
+
+    for (i = 0; i < ctx->nact; i++) {
+        if (ctx->act[i]->state != ST_DONE) cancel(ctx, ctx->act[i]);
+    }
+    for (; ctx->next < ctx->nsources; ctx->next++)
+        cancel(ctx, ctx->sources[ctx->next]);
+    ctx->nact = 0;
+    ctx->running = 0;
+
+    #ifdef __linux__
+    if (ctx->epfd >= 0) syncepoll(ctx, NULL);
+    #endif
+}
+
+
+/* A file descriptor that becomes readable when htp_step() is due, for
+   the event loop of the caller. Linux only (epoll and timerfd), -1 on
+   other systems; use htp_timeout() there.
+*/
+int htp_fd(struct htp_ctx *ctx) {
+    #ifdef __linux__
+    struct epoll_event  ev;
+    struct timespec     due;
+
+    if (ctx->epfd >= 0) return ctx->epfd;
+
+    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = ctx->tfd;
+    if (ctx->epfd < 0 || ctx->tfd < 0 || epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->tfd, &ev)) {
+        if (ctx->epfd >= 0) close(ctx->epfd);
+        if (ctx->tfd >= 0) close(ctx->tfd);
+        ctx->epfd = ctx->tfd = -1;
+        return -1;
+    }
+    syncepoll(ctx, nextdue(ctx, &due));
+    return ctx->epfd;
+    #else
+    return -1;
+    #endif
+}
+
+
+/* Milliseconds until htp_step() is due at the latest, -1 when idle */
+long htp_timeout(const struct htp_ctx *ctx) {
+    struct timespec now, due;
+    long long       ns;
+
+    if (nextdue(ctx, &due) == NULL) return -1;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ns = nsdiff(&due, &now);
+    return ns > 0 ? (long)(ns / 1000000) : 0;
+}
+
+
+/* Block until htp_step() has something to do */
+void htp_wait(struct htp_ctx *ctx) {
+    long    timeout = htp_timeout(ctx);
+    int     n;
+
+    if (timeout == 0 || ctx->running == 0) return;
+    n = pollset(ctx);
+    poll(ctx->pfd, (nfds_t)n, timeout > INT_MAX ? INT_MAX : (int)timeout);
+}
+
+
+/* Measure all sources, blocking. Returns the number of time offsets. */
+int htp_run(struct htp_ctx *ctx) {
+    int i, good = 0;
+
+    if (htp_start(ctx)) return -1;
+    while (htp_step(ctx) > 0) htp_wait(ctx);
+
+    for (i = 0; i < ctx->nsources; i++) {
+        if (ctx->sources[i]->result.status == HTP_OK) good++;
+    }
+    return good;
+}
+
+
+/* The local clock was stepped or slewed by delta seconds, move the
+   predicted second boundaries along
+*/
+void htp_adjusted(struct htp_ctx *ctx, double delta) {
+    int i;
+
+    for (i = 0; i < ctx->nsources; i++)
+        track_shift(&ctx->sources[i]->track, delta);
+}
+
+
+const struct htp_result *htp_result(const struct htp_ctx *ctx, int source) {
+    if (source < 0 || source >= ctx->nsources) return NULL;
+    return &ctx->sources[source]->result;
+}
+
+
+/* Log the latency histogram of every phase of the last measurement,
+   as counts per power of two
+*/
+void htp_histogram(const struct htp_ctx *ctx) {
+    char            line[LOGSIZE];
+    unsigned long   total;
+    long long       bound;
+    size_t          len;
+    int             ph, b;
+
+    htplog(ctx, 0, "Latency    count  (< upper bound: count)");
+    for (ph = 0; ph < PH_COUNT; ph++) {
+        for (b = 0, total = 0; b < HIST_BUCKETS; b++) total += ctx->hist[ph][b];
+        if (total == 0) continue;
+
+        len = (size_t)snprintf(line, sizeof(line), "%-8s %7lu ", phasename[ph], total);
+        for (b = 0; b < HIST_BUCKETS && len < sizeof(line); b++) {
+            if (ctx->hist[ph][b] == 0) continue;
+            bound = 1LL << b;
+            if (bound < 1000)
+                len += (size_t)snprintf(line + len, sizeof(line) - len, " %lldns:%lu", bound, ctx->hist[ph][b]);
+            else if (bound < 1000000)
+                len += (size_t)snprintf(line + len, sizeof(line) - len, " %lldus:%lu", bound / 1000, ctx->hist[ph][b]);
+            else if (bound < HTP_NS)
+                len += (size_t)snprintf(line + len, sizeof(line) - len, " %lldms:%lu", bound / 1000000, ctx->hist[ph][b]);
+            else
+                len += (size_t)snprintf(line + len, sizeof(line) - len, " %llds:%lu", bound / HTP_NS, ctx->hist[ph][b]);
+        }
+        htplog(ctx, 0, "%s", line);
+    }
+}
+
+
+/* Count the heap allocations of OpenSSL for htp_memory(). OpenSSL only
+   takes the hooks before it allocates anything, so call this first in
+   main(), before any htp_new(). Returns -1 when it's too late, or
+   without HTTPS.
+*/
+int htp_count_tls(void) {
+    #ifdef ENABLE_HTTPS
+    return CRYPTO_set_mem_functions(tlsmalloc, tlsrealloc, tlsfree) ? 0 : -1;
+    #else
+    return -1;
+    #endif
+}
+
+
+/* Memory use of the current or last measurement */
+void htp_memory(const struct htp_ctx *ctx, struct htp_memory *m) {
+    m->arena = ctx->arena.size;
+    m->used = ctx->arena.used;
+    m->peak = ctx->arena.peak;
+    m->allocs = ctx->arena.allocs;
+    m->failed = ctx->arena.failed;
+    #ifdef ENABLE_HTTPS
+    m->tlsallocs = tlsallocs - ctx->tlsmark;
+    #else
+    m->tlsallocs = 0;
+    #endif
+}
+
+
+const char *htp_strerror(int status) {
+    switch (status) {
+        case HTP_IDLE:          return "not measured";
+        case HTP_RUNNING:       return "running";
+        case HTP_OK:            return "ok";
+        case HTP_ERR_RESOLVE:   return "host or service unavailable";
+        case HTP_ERR_CONNECT:   return "connection failed";
+        case HTP_ERR_PROXY:     return "proxy error";
+        case HTP_ERR_TLS:       return "TLS error";
+        case HTP_ERR_HTTP:      return "HTTP error";
+        case HTP_ERR_TIMESTAMP: return "no timestamp";
+        case HTP_ERR_TIMEOUT:   return "timeout";
+        case HTP_ERR_MEMORY:    return "out of memory";
+        case HTP_ERR_STALE:     return "stale Date";
+        case HTP_ERR_BUSY:      return "server busy";
+        case HTP_ERR_BUDGET:    return "request budget exhausted";
+        case HTP_CANCELLED:     return "cancelled";
+        default:                return "unknown";
+    }
+}
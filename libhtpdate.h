@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * libhtpdate, time offsets of web servers without blocking the caller
+ *
+ *   struct htp_options opt;
+ *   htp_defaults(&opt);
+ *   ctx = htp_new(&opt);
+ *   htp_add_source(ctx, "https://www.example.com");
+ *   htp_start(ctx);
+ *   while (htp_step(ctx) > 0)
+ *       wait for htp_fd(ctx) to become readable, or htp_timeout(ctx) ms
+ *   htp_result(ctx, 0)->offset
+ *
+ * Host names are resolved by a thread per lookup, no more than there
+ * are connections, so no call blocks on the resolver. A context is not
+ * thread safe, but contexts are independent.
+ */
+
+#ifndef LIBHTPDATE_H
+#define LIBHTPDATE_H
+
+#include <stdio.h>
+
+#include "htp.h"
+
+#define HTP_VERSION         "2.0.2"
+
+/* Status of a source in the current measurement */
+enum htp_status {
+    HTP_IDLE = 0,                           /* Not measured (yet) */
+    HTP_RUNNING,
+    HTP_OK,
+    HTP_ERR_RESOLVE,
+    HTP_ERR_CONNECT,
+    HTP_ERR_PROXY,
+    HTP_ERR_TLS,
+    HTP_ERR_HTTP,                           /* Sending, receiving or protocol */
+    HTP_ERR_TIMESTAMP,                      /* No (valid) Date header */
+    HTP_ERR_TIMEOUT,
+    HTP_ERR_MEMORY,                         /* Arena exhausted */
+    HTP_ERR_STALE,                          /* Date from a cache */
+    HTP_ERR_BUSY,                           /* 429 or 503, backing off */
+    HTP_ERR_BUDGET,                         /* Request budget exhausted */
+    HTP_CANCELLED
+};
+
+struct htp_result {
+    int         status;                     /* enum htp_status */
+    double      offset;                     /* Web server minus local time, s */
+    double      rtt;                        /* Round trip time of last request, s */
+    double      network;                    /* its network part (TCP_INFO), 0 if unknown */
+    double      server;                     /* and the time the server took to answer */
+    int         requests;                   /* Requests sent */
+    int         precision;                  /* Bisection steps done */
+    int         hires;                      /* Offset from a timestamp header */
+    int         http2;
+    int         ktls;                       /* Offloaded to kernel TLS: 1 send, 2 receive, 3 both */
+    const char  *host, *port;
+    const char  *address;                   /* Of an expanded host, or NULL */
+};
+
+struct htp_options {
+    int         precision;                  /* 1..9, 0 for automatic */
+    int         ipversion;                  /* 4, 6 or 0 for both */
+    int         httpversion;                /* HTTP/1.x minor version */
+    int         http2;                      /* Offer HTTP/2 for https */
+    int         ktls;                       /* Kernel TLS offload, if available */
+    int         verifycert;
+    int         debug;
+    int         maxactive;                  /* Concurrent sources, 0 for all */
+    int         tracking;                   /* Probe around the predicted second boundary */
+    int         budget;                     /* Requests per source per hour, 0 for no limit */
+    int         timeout;                    /* Per connect and request, ms */
+    const char  *proxy;                     /* [user:pass@]host[:port] */
+    FILE        *capture;                   /* Binary capture of requests */
+    size_t      arena;                      /* Per measurement memory, 0 for the heap */
+    void        (*log)(void *arg, int is_error, const char *message);
+    void        *logarg;
+    /* Called when the measurement of a source ends, from htp_step(),
+       htp_stop() or htp_free() (only the sources under way); it must not
+       start, stop or free the context
+    */
+    void        (*done)(void *arg, int source, const struct htp_result *result);
+    void        *donearg;
+};
+
+struct htp_memory {
+    size_t      arena, used, peak;          /* Bytes, peak since htp_new() */
+    unsigned long allocs;                   /* From the arena */
+    unsigned long failed;                   /* Arena exhausted */
+    unsigned long tlsallocs;                /* Heap allocations by OpenSSL, see htp_count_tls() */
+};
+
+struct htp_ctx;
+
+void htp_defaults(struct htp_options *opt);
+struct htp_ctx *htp_new(const struct htp_options *opt);
+void htp_free(struct htp_ctx *ctx);
+
+int htp_add_source(struct htp_ctx *ctx, const char *url);
+int htp_expand_source(struct htp_ctx *ctx, const char *url, int max);
+int htp_sources(const struct htp_ctx *ctx);
+
+int htp_start(struct htp_ctx *ctx);
+int htp_step(struct htp_ctx *ctx);
+void htp_stop(struct htp_ctx *ctx);
+int htp_fd(struct htp_ctx *ctx);
+long htp_timeout(const struct htp_ctx *ctx);
+void htp_wait(struct htp_ctx *ctx);
+int htp_run(struct htp_ctx *ctx);
+void htp_adjusted(struct htp_ctx *ctx, double delta);
+
+const struct htp_result *htp_result(const struct htp_ctx *ctx, int source);
+int htp_count_tls(void);
+void htp_memory(const struct htp_ctx *ctx, struct htp_memory *m);
+void htp_histogram(const struct htp_ctx *ctx);
+const char *htp_strerror(int status);
+
+#endif
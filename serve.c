@@ -0,0 +1,383 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Time server, answers HTTP requests with the Date and a high
+ * resolution timestamp of the local clock
+ *
+ * HEAD and GET requests of any path get an empty 200 response with
+ *
+ *   Date: Sat, 18 Oct 2026 17:50:09 GMT
+ *   X-Timestamp: 1792345809.123456789
+ *
+ * both read from CLOCK_REALTIME right before the response is sent, so
+ * htpdate clients with URL#X-Timestamp need a single request instead of
+ * a bisection. While the local clock isn't synchronized, clients get a
+ * 503 without timestamp instead, so they don't copy it.
+ *
+ * One thread runs a level triggered epoll loop over the listening socket
+ * and all (keep-alive, pipelined) connections. A client that doesn't
+ * take its few hundred byte response at once is disconnected rather
+ * than buffered for, as is one that stays silent for IDLE_TIMEOUT.
+ */
+
+/* Needed for accept4, memmem and strcasestr */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timex.h>
+#endif
+
+#include "serve.h"
+
+#define LISTEN_BACKLOG           1024
+#define MAX_EVENTS               256
+#define REQUESTSIZE              2048              /* request line and headers */
+#define RESPONSESIZE             256
+#define LOGSIZE                  256
+#define RETRY_AFTER              60                /* s, while not synchronized */
+#define IDLE_TIMEOUT             30                /* s, silent keep-alive connections */
+#define ACCEPT_PAUSE             1                 /* s, without file descriptors */
+#define LOG_INTERVAL             60                /* s, between repeated errors */
+
+/* Clients are kept in order of their last activity, the least recent
+   first, so the idle ones are found at the head
+*/
+struct client {
+    int             fd;
+    time_t          last;
+    struct client   *prev, *next;
+    size_t          length;
+    char            buffer[REQUESTSIZE];
+};
+
+struct clients {
+    struct client   *head, *tail;
+    int             left;               /* disconnected since last asked */
+};
+
+
+static void serverlog(void (*log)(void *, int, const char *), void *logarg, int is_error, const char *format, ...) {
+    va_list args;
+    char    buf[LOGSIZE];
+
+    if (log == NULL) return;
+    va_start(args, format);
+    (void) vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    log(logarg, is_error, buf);
+}
+
+
+#ifdef __linux__
+static int listenon(const char *port, int family) {
+    struct addrinfo hints, *res, *ai;
+    int             fd = -1, on = 1, off = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0) return -1;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        /* One socket for IPv6 and IPv4 */
+        if (ai->ai_family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, LISTEN_BACKLOG) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+/* Listening socket on all addresses, IPv6 and IPv4 unless ipversion
+   is 4 or 6. Returns -1 on failure.
+*/
+int serve_open(const char *port, int ipversion) {
+    int fd;
+
+    if (ipversion == 4) return listenon(port, AF_INET);
+    if (ipversion == 6) return listenon(port, AF_INET6);
+    if ((fd = listenon(port, AF_INET6)) >= 0) return fd;
+    return listenon(port, AF_INET);
+}
+
+
+static time_t uptime(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+
+static void unlink_client(struct clients *list, struct client *c) {
+    if (c->prev) c->prev->next = c->next;
+    else list->head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else list->tail = c->prev;
+}
+
+
+/* Mark a client active, it moves to the tail */
+static void touch(struct clients *list, struct client *c, time_t now) {
+    if (list->tail != c) {
+        if (c->prev || list->head == c) unlink_client(list, c);
+        c->prev = list->tail;
+        c->next = NULL;
+        if (list->tail) list->tail->next = c;
+        else list->head = c;
+        list->tail = c;
+    }
+    c->last = now;
+}
+
+
+static void disconnect(int epfd, struct clients *list, struct client *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    unlink_client(list, c);
+    free(c);
+    list->left++;
+}
+
+
+/* Synchronized according to htpdate itself (its last poll cycle), or
+   without it according to the kernel, as kept by another daemon
+*/
+static int insync(const volatile int *synced) {
+    struct timex    tmx = {0};
+
+    if (synced) return *synced;
+    return adjtimex(&tmx) != TIME_ERROR && !(tmx.status & STA_UNSYNC);
+}
+
+
+/* Answer one request (line and headers, NUL terminated). Returns 0 to
+   keep the connection, -1 to close it.
+*/
+static int answer(struct client *c, const char *request, const volatile int *synced) {
+    static time_t   cached;
+    static char     date[32];
+    static int      sync;
+    struct timespec now;
+    struct tm       tm;
+    char            response[RESPONSESIZE], stamp[48] = {'\0'};
+    int             n, ok, keep;
+    const char      *status, *eol = strstr(request, "\r\n");
+
+    ok = strncmp(request, "HEAD ", 5) == 0 || strncmp(request, "GET ", 4) == 0;
+
+    /* HTTP/1.0 closes unless asked otherwise, HTTP/1.1 keeps unless asked otherwise */
+    if (eol && eol - request >= 8 && strncmp(eol - 8, "HTTP/1.0", 8) == 0)
+        keep = strcasestr(request, "\nConnection: keep-alive") != NULL;
+    else
+        keep = strcasestr(request, "\nConnection: close") == NULL;
+    if (!ok) keep = 0;
+
+    /* The Date and the synchronization only change once a second */
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != cached) {
+        gmtime_r(&now.tv_sec, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        sync = insync(synced);
+        cached = now.tv_sec;
+    }
+
+    if (!ok) {
+        status = "405 Method Not Allowed";
+        strcpy(stamp, "Allow: GET, HEAD\r\n");
+    } else if (!sync) {
+        status = "503 Service Unavailable";
+        snprintf(stamp, sizeof(stamp), "Retry-After: %d\r\n", RETRY_AFTER);
+    } else {
+        status = "200 OK";
+        snprintf(stamp, sizeof(stamp), SERVE_HEADER ": %lld.%09ld\r\n", (long long)now.tv_sec, now.tv_nsec);
+    }
+
+    n = snprintf(response, sizeof(response),
+        "HTTP/1.1 %s\r\n"
+        "Date: %s\r\n"
+        "%s"
+        "Server: htpdate\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: %s\r\n\r\n",
+        status, date, stamp, keep ? "keep-alive" : "close");
+
+    if (send(c->fd, response, (size_t)n, MSG_NOSIGNAL | MSG_DONTWAIT) != n) return -1;
+    return keep ? 0 : -1;
+}
+
+
+/* Read what a client sent and answer every complete request in it.
+   Returns -1 when the connection is to be closed.
+*/
+static int readable(struct client *c, const volatile int *synced) {
+    char    *end;
+    ssize_t n;
+    size_t  used;
+
+    for (;;) {
+        n = recv(c->fd, c->buffer + c->length, REQUESTSIZE - 1 - c->length, 0);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (n == 0) return -1;
+        c->length += (size_t)n;
+        c->buffer[c->length] = '\0';
+
+        /* Pipelined requests are answered in order */
+        while ((end = memmem(c->buffer, c->length, "\r\n\r\n", 4)) != NULL) {
+            end[2] = '\0';
+            if (answer(c, c->buffer, synced)) return -1;
+            used = (size_t)(end + 4 - c->buffer);
+            c->length -= used;
+            memmove(c->buffer, end + 4, c->length + 1);
+        }
+
+        /* Too large to be a HEAD request for the time */
+        if (c->length >= REQUESTSIZE - 1) return -1;
+    }
+}
+
+
+/* Accept connections and answer requests, forever. synced is set by
+   the process that keeps the clock in sync, NULL to ask the kernel.
+   Returns -1 if the event loop can't be set up or fails.
+*/
+int serve_run(int fd, const volatile int *synced, void (*log)(void *arg, int is_error, const char *message), void *logarg) {
+    struct epoll_event  ev, events[MAX_EVENTS];
+    struct clients      list = {NULL, NULL, 0};
+    struct client       *c;
+    struct rlimit       rl;
+    time_t              now, pausedat = 0, logged = 0;
+    int                 epfd, cfd, i, n, timeout, paused = 0, logged_once = 0, on = 1;
+
+    /* Every connection is a file descriptor */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        serverlog(log, logarg, 1, "epoll: %s", strerror(errno));
+        return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        serverlog(log, logarg, 1, "epoll: %s", strerror(errno));
+        close(epfd);
+        return -1;
+    }
+
+    for (;;) {
+        /* Wake up for the least recently active client to time out,
+           and to retry accepting while paused
+        */
+        now = uptime();
+        timeout = -1;
+        if (list.head) timeout = (int)(list.head->last + IDLE_TIMEOUT - now) * 1000;
+        if (timeout < 0 && list.head) timeout = 0;
+        if (paused && (timeout < 0 || timeout > ACCEPT_PAUSE * 1000)) timeout = ACCEPT_PAUSE * 1000;
+
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, timeout)) < 0) {
+            if (errno == EINTR) continue;
+            serverlog(log, logarg, 1, "epoll: %s", strerror(errno));
+            close(epfd);
+            return -1;
+        }
+        now = uptime();
+
+        for (i = 0; i < n; i++) {
+            if ((c = events[i].data.ptr) != NULL) {
+                if (events[i].events & (EPOLLERR | EPOLLHUP) || readable(c, synced))
+                    disconnect(epfd, &list, c);
+                else
+                    touch(&list, c, now);
+                continue;
+            }
+
+            /* New connections, as many as are waiting */
+            while ((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                if ((c = malloc(sizeof(struct client))) == NULL) {
+                    close(cfd);
+                    continue;
+                }
+                /* A timestamp must not wait for the previous response to be acknowledged */
+                setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                c->fd = cfd;
+                c->length = 0;
+                c->prev = c->next = NULL;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev)) {
+                    close(cfd);
+                    free(c);
+                    continue;
+                }
+                touch(&list, c, now);
+            }
+
+            /* Out of file descriptors, stop listening until a client
+               leaves (or for a while) instead of spinning on the pending
+               connection
+            */
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if (!logged_once || now - logged >= LOG_INTERVAL) {
+                    serverlog(log, logarg, 1, "accept: %s", strerror(errno));
+                    logged = now;
+                    logged_once = 1;
+                }
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                paused = 1;
+                pausedat = now;
+                list.left = 0;
+            }
+        }
+
+        /* Silent keep-alive connections hold a file descriptor each */
+        while (list.head && now - list.head->last >= IDLE_TIMEOUT)
+            disconnect(epfd, &list, list.head);
+
+        if (paused && (list.left || now - pausedat >= ACCEPT_PAUSE)) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = NULL;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            paused = 0;
+        }
+    }
+}
+#else
+int serve_open(const char *port, int ipversion) {
+    (void)port;
+    (void)ipversion;
+    return -1;
+}
+
+
+int serve_run(int fd, const volatile int *synced, void (*log)(void *arg, int is_error, const char *message), void *logarg) {
+    (void)fd;
+    (void)synced;
+    serverlog(log, logarg, 1, "Server mode needs epoll (Linux)");
+    return -1;
+}
+#endif
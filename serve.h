@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Time server, answers HTTP requests with the Date and a high
+ * resolution timestamp of the local clock
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#define SERVE_HEADER        "X-Timestamp"   /* s.ns since the epoch */
+
+int serve_open(const char *port, int ipversion);
+int serve_run(int fd, const volatile int *synced, void (*log)(void *arg, int is_error, const char *message), void *logarg);
+
+#endif
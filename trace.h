@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Static trace points (USDT) for perf, bpftrace and SystemTap, e.g.
+ *
+ *   bpftrace -e 'usdt:./htpdate:htpdate:ttfb { @[arg0] = hist(arg1); }'
+ *
+ * Only with -DHAVE_SDT and sys/sdt.h (systemtap-sdt-dev), otherwise
+ * they compile to nothing. Probes take the source and a duration in ns.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define HTP_PROBE(name, source, ns)     DTRACE_PROBE2(htpdate, name, source, ns)
+#else
+#define HTP_PROBE(name, source, ns)     do { } while (0)
+#endif
+
+#endif